@@ -0,0 +1,923 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * kwmbench drives a running kwm like a busy session would and reports
+ * how long it takes to react. It maps and unmaps windows, spams titles,
+ * toggles fullscreen and types C-t chords through XTest, then prints
+ * one line per scenario:
+ *
+ *   bench=<name> ops=<n> timeouts=<n> p50_us=<f> p99_us=<f> max_us=<f> cpu_us_per_op=<f>
+ *
+ * Latencies run from the request to the event that shows kwm handled
+ * it, CPU time is what kwm itself spent, read from /proc. The text and
+ * truncate scenarios are the exception, they time drw_text on
+ * mixed-script titles in kwmbench itself, truncate on a 1 KB one.
+ * Before those comes the server memory kwm's pixmaps take up:
+ *
+ *   kwm_pixmap_bytes=<n>
+ *
+ * The ipc and ipc_batch scenarios time IPC requests up to kwm's reply,
+ * one IpcNextClient and BATCH of them in one message, and like restart
+ * they run only when KWM_SOCKET is set.
+ *
+ * The split and remove scenarios split the selected frame through C-t s
+ * and C-t S, DEPTH times or as often as the screen allows, then merge
+ * the frames again through C-t R. Each op is timed to the first resize
+ * it causes. Then come the splits made and the number of windows kwm
+ * resized per op, which bench.sh reports for a 4K screen by running
+ * them again alone with -s split:
+ *
+ *   split_depth=<n> split_configures_per_op=<f> remove_configures_per_op=<f>
+ *
+ * The configure scenario moves a window kwm doesn't manage, which kwm
+ * finds in its cache of misses after the first, and configure_managed
+ * moves clients picked at random, which it finds in its index. Both are timed to the ConfigureNotify and run with the
+ * windows of map and again with MANYWINS mapped, named after the
+ * count, to show the lookup of the window doesn't grow with it.
+ *
+ * The reconfigure scenario switches the output through RandR between
+ * its mode and one two thirds its size, timed until kwm has resized
+ * all the windows of map, hotplugdelay included. bench.sh runs it again
+ * alone with -n 50. Given kwm's stderr with -l, and kwm built with
+ * STATS, it is followed by what kwm's statistics counted per switch:
+ *
+ *   reconfigure_syncs_per_op=<f> reconfigure_roundtrips_per_op=<f>
+ *
+ * The restart scenario needs KWM_SOCKET to ask kwm to restart. It times
+ * the restart up to kwm listing the windows again and is followed by
+ * the number of restarts that changed the client list, the focus or
+ * the fullscreen window:
+ *
+ *   restart_mismatches=<n>
+ */
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xft/Xft.h>
+#include <X11/extensions/XRes.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/XTest.h>
+#include <X11/keysym.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drw.h"
+#include "ipc.h"
+#include "util.h"
+
+#define TIMEOUT 2000 /* ms to wait for kwm to react */
+#define RESTARTS 20  /* restarts timed, each execs kwm */
+#define RECONFIGURES 20 /* screen changes timed, each waits out hotplugdelay */
+#define BATCH    1000 /* commands in an ipc_batch message */
+#define DEPTH    10   /* nested splits, ~120x67 frames on a 4K screen */
+#define FRAMEMIN 64   /* framemin in config.h */
+#define MANYWINS 5000 /* windows mapped for the second configure run */
+#define LENGTH(X) (sizeof X / sizeof X[0])
+
+typedef struct {
+	const char *name;
+	long long *lat; /* ns, one per op that is waited for */
+	int ops, n, timeouts;
+	pid_t pid; /* whose CPU time is counted */
+	long long cpu0;
+} Run;
+
+static long long now(void);
+static long long cputime(pid_t);
+static void settle(pid_t);
+static void begin(Run *, const char *, int, pid_t);
+static void sample(Run *, long long);
+static void end(Run *);
+static int cmp(const void *, const void *);
+static int waitevent(Window, int, XEvent *);
+static Window createwin(void);
+static void pace(long long);
+static void chord(KeySym, KeySym);
+static void setfullscreen(Window, int);
+static Window wmcheck(void);
+static int clientlist(Window **);
+static int ipcconnect(void);
+static int ipcrequest(int, const unsigned char *, size_t);
+static int ipcrestart(void);
+static unsigned long pixmapbytes(void);
+static void split(void);
+static void configure(void);
+static int readstats(unsigned long *, unsigned long *);
+static int kwmstats(unsigned long *, unsigned long *);
+static void reconfigure(void);
+static void text(void);
+static int want(const char *);
+static void usage(void);
+
+static Display *dpy;
+static Window root;
+static pid_t kwm;
+static Atom netwmstate, netwmfullscreen, netwmname, utf8string, netclientlist;
+static int nwins = 100, rate, nops = 200;
+static const char *only; /* the scenario -s asks for, besides map */
+static const char *statslog; /* kwm's stderr, for what it prints on SIGUSR1 */
+static Window *wins, focused;
+static const char *titles[] = {
+	"README.org - GNU Emacs",
+	"Привет, мир — Mozilla Firefox",
+	"東京の天気 - Chromium",
+	"서울 날씨 ☀ 25°C - Chromium",
+	"مرحبا بالعالم - gedit",
+	"Ελληνικά και English ✓ mixed",
+	"🙂 #general — Signal",
+	"नमस्ते दुनिया — Terminal",
+};
+
+long long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ns of CPU the process has used, from schedstat when there is one */
+long long
+cputime(pid_t pid)
+{
+	char path[64];
+	unsigned long long ns, ut, st;
+	FILE *f;
+	int i;
+
+	snprintf(path, sizeof(path), "/proc/%d/schedstat", (int)pid);
+	if ((f = fopen(path, "r"))) {
+		i = fscanf(f, "%llu", &ns);
+		fclose(f);
+		if (i == 1)
+			return ns;
+	}
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if (!(f = fopen(path, "r")))
+		return 0;
+	/* utime and stime are fields 14 and 15, after the (comm) field */
+	i = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &ut, &st);
+	fclose(f);
+	return i == 2 ? (ut + st) * 1000000000LL / sysconf(_SC_CLK_TCK) : 0;
+}
+
+/* waits until the process has gone idle, so its CPU time covers all of a run */
+void
+settle(pid_t pid)
+{
+	long long t, last = -1;
+	int idle = 0;
+
+	XSync(dpy, False);
+	while (idle < 2) {
+		usleep(20000);
+		t = cputime(pid);
+		idle = t == last ? idle + 1 : 0;
+		last = t;
+	}
+}
+
+void
+begin(Run *r, const char *name, int n, pid_t pid)
+{
+	r->name = name;
+	r->lat = ecalloc(n, sizeof(long long));
+	r->ops = r->n = r->timeouts = 0;
+	r->pid = pid;
+	settle(pid);
+	r->cpu0 = cputime(pid);
+}
+
+void
+sample(Run *r, long long t0)
+{
+	r->ops++;
+	if (t0 < 0)
+		r->timeouts++;
+	else
+		r->lat[r->n++] = now() - t0;
+}
+
+void
+end(Run *r)
+{
+	long long cpu;
+
+	settle(r->pid);
+	cpu = cputime(r->pid) - r->cpu0;
+	qsort(r->lat, r->n, sizeof(long long), cmp);
+	printf("bench=%s ops=%d timeouts=%d p50_us=%.1f p99_us=%.1f max_us=%.1f cpu_us_per_op=%.1f\n",
+		r->name, r->ops, r->timeouts,
+		r->n ? r->lat[r->n / 2] / 1e3 : 0.0,
+		r->n ? r->lat[(r->n * 99) / 100] / 1e3 : 0.0,
+		r->n ? r->lat[r->n - 1] / 1e3 : 0.0,
+		r->ops ? cpu / 1e3 / r->ops : 0.0);
+	fflush(stdout);
+	free(r->lat);
+}
+
+int
+cmp(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Waits for an event of the type on w, or on any window when w is
+ * None. Focus moving with kwm's keyboard grab doesn't count. */
+int
+waitevent(Window w, int type, XEvent *ev)
+{
+	struct pollfd pfd = { ConnectionNumber(dpy), POLLIN, 0 };
+	long long deadline = now() + TIMEOUT * 1000000LL;
+
+	for (;;) {
+		while (XPending(dpy)) {
+			XNextEvent(dpy, ev);
+			if (ev->type == FocusIn) {
+				if (ev->xfocus.mode == NotifyGrab || ev->xfocus.mode == NotifyUngrab
+				|| ev->xfocus.detail == NotifyPointer)
+					continue;
+				focused = ev->xfocus.window;
+			}
+			if (ev->type == type && (w == None || ev->xany.window == w))
+				return 1;
+		}
+		if (now() >= deadline || poll(&pfd, 1, (deadline - now()) / 1000000 + 1) <= 0)
+			return 0;
+	}
+}
+
+Window
+createwin(void)
+{
+	XSetWindowAttributes wa = { .event_mask = FocusChangeMask|StructureNotifyMask };
+	Window w;
+
+	w = XCreateWindow(dpy, root, 0, 0, 320, 240, 0, CopyFromParent, InputOutput,
+		CopyFromParent, CWEventMask, &wa);
+	XStoreName(dpy, w, "kwmbench");
+	XSetClassHint(dpy, w, &(XClassHint){ "kwmbench", "Kwmbench" });
+	return w;
+}
+
+/* sleeps out the rest of the op started at t0 when a rate is given */
+void
+pace(long long t0)
+{
+	long long left;
+
+	if (rate && (left = t0 + 1000000000LL / rate - now()) > 0)
+		usleep(left / 1000);
+}
+
+/* types C-prefix then key, with shift held for upper case keys */
+void
+chord(KeySym prefix, KeySym key)
+{
+	KeyCode ctrl = XKeysymToKeycode(dpy, XK_Control_L);
+	KeyCode shift = XKeysymToKeycode(dpy, XK_Shift_L);
+	KeyCode p = XKeysymToKeycode(dpy, prefix), k = XKeysymToKeycode(dpy, key);
+	KeySym lower, upper;
+
+	XConvertCase(key, &lower, &upper);
+	XTestFakeKeyEvent(dpy, ctrl, True, CurrentTime);
+	XTestFakeKeyEvent(dpy, p, True, CurrentTime);
+	XTestFakeKeyEvent(dpy, p, False, CurrentTime);
+	XTestFakeKeyEvent(dpy, ctrl, False, CurrentTime);
+	if (key != lower)
+		XTestFakeKeyEvent(dpy, shift, True, CurrentTime);
+	XTestFakeKeyEvent(dpy, k, True, CurrentTime);
+	XTestFakeKeyEvent(dpy, k, False, CurrentTime);
+	if (key != lower)
+		XTestFakeKeyEvent(dpy, shift, False, CurrentTime);
+	XFlush(dpy);
+}
+
+void
+setfullscreen(Window w, int on)
+{
+	XEvent ev = { .xclient = {
+		.type = ClientMessage, .window = w, .message_type = netwmstate,
+		.format = 32, .data.l = { on ? 1 : 0, netwmfullscreen, 0, 1, 0 } } };
+
+	XSendEvent(dpy, root, False, SubstructureRedirectMask|SubstructureNotifyMask, &ev);
+	XFlush(dpy);
+}
+
+/* kwm sets _NET_SUPPORTING_WM_CHECK once it manages the screen */
+Window
+wmcheck(void)
+{
+	Atom type;
+	int format;
+	unsigned long n, after;
+	unsigned char *p = NULL;
+	Window w = None;
+
+	if (XGetWindowProperty(dpy, root, XInternAtom(dpy, "_NET_SUPPORTING_WM_CHECK", False),
+		0, 1, False, XA_WINDOW, &type, &format, &n, &after, &p) != Success)
+		return None;
+	if (n > 0)
+		w = *(Window *)p;
+	XFree(p);
+	return w;
+}
+
+/* kwm's _NET_CLIENT_LIST, to be freed with XFree */
+int
+clientlist(Window **list)
+{
+	Atom type;
+	int format;
+	unsigned long n = 0, after;
+	unsigned char *p = NULL;
+
+	if (XGetWindowProperty(dpy, root, netclientlist, 0, 4 * nwins, False,
+		XA_WINDOW, &type, &format, &n, &after, &p) != Success)
+		n = 0;
+	*list = (Window *)p;
+	return n;
+}
+
+/* connects to kwm's IPC socket, see ipc.h, -1 if there is none */
+int
+ipcconnect(void)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct timeval tv = { TIMEOUT / 1000, TIMEOUT % 1000 * 1000 };
+	const char *path = getenv("KWM_SOCKET");
+	int fd;
+
+	if (!path || strlen(path) >= sizeof(sa.sun_path))
+		return -1;
+	strcpy(sa.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* sends a request and waits for the reply, returns whether kwm ran all
+ * of its commands */
+int
+ipcrequest(int fd, const unsigned char *msg, size_t len)
+{
+	IpcMsg m;
+
+	return send(fd, msg, len, 0) == len
+		&& recv(fd, &m, sizeof(m), 0) == sizeof(m)
+		&& m.type == IpcReply && m.status == IpcOk;
+}
+
+/* asks kwm to restart, the reply comes before it execs */
+int
+ipcrestart(void)
+{
+	unsigned char op = IpcRestart;
+	int fd, ok;
+
+	if ((fd = ipcconnect()) < 0)
+		return 0;
+	ok = ipcrequest(fd, &op, 1);
+	close(fd);
+	return ok;
+}
+
+/* server memory held by kwm's pixmaps, kwm being the client that owns
+ * its check window */
+unsigned long
+pixmapbytes(void)
+{
+	XResClient *c;
+	Window w = wmcheck();
+	unsigned long bytes = 0;
+	int i, n;
+
+	if (!XResQueryClients(dpy, &n, &c))
+		return 0;
+	for (i = 0; i < n; i++)
+		if ((w & ~c[i].resource_mask) == c[i].resource_base)
+			XResQueryClientPixmapBytes(dpy, c[i].resource_base, &bytes);
+	XFree(c);
+	return bytes;
+}
+
+/* split: nesting frames DEPTH deep, remove: merging them back, each
+ * followed by the resizes it caused, synthetic ConfigureNotify aside */
+void
+split(void)
+{
+	Run r;
+	XEvent ev;
+	XWindowAttributes wa;
+	long long t0;
+	unsigned long n[2] = { 0, 0 };
+	int i, op, ok, depth, fw, fh;
+
+	/* kwm ignores splits of frames under 2 * framemin, which would only
+	 * time out, so the depth is what the focused frame allows */
+	if (focused && XGetWindowAttributes(dpy, focused, &wa)) {
+		fw = wa.width + 2 * wa.border_width;
+		fh = wa.height + 2 * wa.border_width;
+	} else {
+		fw = DisplayWidth(dpy, DefaultScreen(dpy));
+		fh = DisplayHeight(dpy, DefaultScreen(dpy));
+	}
+	for (depth = 0; depth < DEPTH; depth++)
+		if (depth % 2 ? fh < 2 * FRAMEMIN : fw < 2 * FRAMEMIN)
+			break;
+		else if (depth % 2)
+			fh = (fh + 1) / 2;
+		else
+			fw = (fw + 1) / 2;
+	if (!depth)
+		return;
+	for (op = 0; op < 2; op++) {
+		begin(&r, op ? "remove" : "split", depth, kwm);
+		for (i = 0; i < depth; i++) {
+			t0 = now();
+			chord(XK_t, op ? XK_R : i % 2 ? XK_S : XK_s);
+			ok = waitevent(None, ConfigureNotify, &ev);
+			sample(&r, ok ? t0 : -1);
+			n[op] += ok && !ev.xconfigure.send_event;
+			settle(kwm);
+			while (XPending(dpy)) {
+				XNextEvent(dpy, &ev);
+				n[op] += ev.type == ConfigureNotify && !ev.xconfigure.send_event;
+			}
+		}
+		end(&r);
+	}
+	printf("split_depth=%d split_configures_per_op=%.1f remove_configures_per_op=%.1f\n",
+		depth, (double)n[0] / depth, (double)n[1] / depth);
+	fflush(stdout);
+}
+
+/* configure: ConfigureRequests of an unmanaged window, with the windows
+ * of map and then with MANYWINS windows mapped */
+void
+configure(void)
+{
+	Run r;
+	XEvent ev;
+	Window probe, *more, w;
+	long long t0;
+	char name[40];
+	int i, j, n, pass, extra = MAX(MANYWINS - nwins, 0);
+
+	probe = createwin(); /* never mapped, so kwm leaves it alone */
+	more = ecalloc(MAX(extra, 1), sizeof(Window));
+	srand(1);
+	for (pass = 0; pass < 2; pass++) {
+		if (pass) {
+			for (i = 0; i < extra; i++) {
+				more[i] = createwin();
+				XMapWindow(dpy, more[i]);
+			}
+			for (n = 0; n < extra && waitevent(None, MapNotify, &ev); n++);
+			if (n < extra)
+				fputs("kwmbench: kwm stopped mapping windows\n", stderr);
+		}
+		n = nwins + (pass ? extra : 0);
+		snprintf(name, sizeof(name), "configure_%d", n);
+		begin(&r, name, nops, kwm);
+		for (i = 0; i < nops; i++) {
+			t0 = now();
+			XMoveWindow(dpy, probe, i % 2, 0);
+			XFlush(dpy);
+			sample(&r, waitevent(probe, ConfigureNotify, &ev) ? t0 : -1);
+			pace(t0);
+		}
+		end(&r);
+		/* tiled clients, answered with a synthetic ConfigureNotify; the
+		 * first window is left out as restart may have made it fullscreen */
+		snprintf(name, sizeof(name), "configure_managed_%d", n);
+		begin(&r, name, nops, kwm);
+		for (i = 0; i < nops; i++) {
+			j = 1 + rand() % (n - 1);
+			w = j < nwins ? wins[j] : more[j - nwins];
+			t0 = now();
+			XMoveWindow(dpy, w, i % 2, 0);
+			XFlush(dpy);
+			sample(&r, waitevent(w, ConfigureNotify, &ev) ? t0 : -1);
+			pace(t0);
+		}
+		end(&r);
+	}
+	for (i = 0; i < extra; i++)
+		XDestroyWindow(dpy, more[i]);
+	XDestroyWindow(dpy, probe);
+	free(more);
+	/* what follows waits for focus changes of its own */
+	settle(kwm);
+	XSync(dpy, True);
+}
+
+/* Reads the sync and round trip counts of the last statistics kwm
+ * printed, which it does with STATS, and returns how many it printed. */
+int
+readstats(unsigned long *syncs, unsigned long *roundtrips)
+{
+	FILE *f;
+	char line[256];
+	unsigned long n;
+	int dumps = 0;
+
+	if (!statslog || !(f = fopen(statslog, "r")))
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		sscanf(line, "kwm: %lu events, %lu syncs", &n, syncs);
+		/* the later of the two lines, so the dump has both */
+		dumps += sscanf(line, "kwm: %lu requests, %lu round trips", &n, roundtrips) == 2;
+	}
+	fclose(f);
+	return dumps;
+}
+
+/* asks kwm for its statistics, 0 if it doesn't print any */
+int
+kwmstats(unsigned long *syncs, unsigned long *roundtrips)
+{
+	long long deadline = now() + TIMEOUT * 1000000LL;
+	int n = readstats(syncs, roundtrips);
+
+	if (!statslog)
+		return 0;
+	kill(kwm, SIGUSR1);
+	while (readstats(syncs, roundtrips) <= n)
+		if (now() >= deadline)
+			return 0;
+		else
+			usleep(10000);
+	return 1;
+}
+
+/* reconfigure: the output switches to a smaller mode and back, as when
+ * a monitor is swapped, timed until kwm has resized every window */
+void
+reconfigure(void)
+{
+	XRRScreenResources *res;
+	XRRCrtcInfo *ci;
+	XRRModeInfo mi = { 0 };
+	Run r;
+	XEvent ev;
+	RRMode mode[2];
+	RROutput out;
+	long long t0;
+	unsigned long syncs[2], rts[2];
+	char name[32] = "kwmbench";
+	int i, j, k, n, ok, w[2], h[2], ev0, err0, stats, *seen;
+
+	if (!XRRQueryExtension(dpy, &ev0, &err0)
+	|| !(res = XRRGetScreenResourcesCurrent(dpy, root)))
+		return;
+	if (!res->ncrtc || !(ci = XRRGetCrtcInfo(dpy, res, res->crtcs[0])) || !ci->noutput) {
+		fputs("kwmbench: no output to reconfigure\n", stderr);
+		XRRFreeScreenResources(res);
+		return;
+	}
+	out = ci->outputs[0];
+	mode[0] = ci->mode;
+	w[0] = ci->width;
+	h[0] = ci->height;
+	XRRFreeCrtcInfo(ci);
+	XRRFreeScreenResources(res);
+	mi.width = mi.hSyncStart = mi.hSyncEnd = mi.hTotal = w[1] = w[0] * 2 / 3;
+	mi.height = mi.vSyncStart = mi.vSyncEnd = mi.vTotal = h[1] = h[0] * 2 / 3;
+	mi.name = name;
+	mi.nameLength = strlen(name);
+	mode[1] = XRRCreateMode(dpy, root, &mi);
+	XRRAddOutputMode(dpy, out, mode[1]);
+	/* the new mode changed the configuration, so its timestamp */
+	res = XRRGetScreenResourcesCurrent(dpy, root);
+	seen = ecalloc(nwins, sizeof(int));
+
+	stats = kwmstats(&syncs[0], &rts[0]);
+	snprintf(name, sizeof(name), "reconfigure_%d", nwins);
+	begin(&r, name, RECONFIGURES, kwm);
+	for (i = 0; i < RECONFIGURES; i++) {
+		k = !(i % 2); /* an even count ends on the mode it started with */
+		t0 = now();
+		/* the output must fit the screen at every step, as with xrandr */
+		XGrabServer(dpy);
+		if (k)
+			XRRSetCrtcConfig(dpy, res, res->crtcs[0], CurrentTime, 0, 0,
+				mode[k], RR_Rotate_0, &out, 1);
+		XRRSetScreenSize(dpy, root, w[k], h[k],
+			DisplayWidthMM(dpy, DefaultScreen(dpy)) * w[k] / w[!k],
+			DisplayHeightMM(dpy, DefaultScreen(dpy)) * h[k] / h[!k]);
+		if (!k)
+			XRRSetCrtcConfig(dpy, res, res->crtcs[0], CurrentTime, 0, 0,
+				mode[k], RR_Rotate_0, &out, 1);
+		XUngrabServer(dpy);
+		XFlush(dpy);
+		memset(seen, 0, nwins * sizeof(int));
+		for (n = 0, ok = 1; n < nwins && (ok = waitevent(None, ConfigureNotify, &ev));) {
+			if (ev.xconfigure.send_event)
+				continue;
+			for (j = 0; j < nwins && wins[j] != ev.xconfigure.window; j++);
+			if (j < nwins && !seen[j]++)
+				n++;
+		}
+		sample(&r, ok ? t0 : -1);
+		pace(t0);
+	}
+	end(&r);
+	if (stats && kwmstats(&syncs[1], &rts[1])) {
+		printf("reconfigure_syncs_per_op=%.1f reconfigure_roundtrips_per_op=%.1f\n",
+			(double)(syncs[1] - syncs[0]) / RECONFIGURES,
+			(double)(rts[1] - rts[0]) / RECONFIGURES);
+		fflush(stdout);
+	}
+	XRRDeleteOutputMode(dpy, out, mode[1]);
+	XRRDestroyMode(dpy, mode[1]);
+	XRRFreeScreenResources(res);
+	free(seen);
+	settle(kwm);
+	XSync(dpy, True);
+}
+
+/* text: drawing titles whose glyphs come from several fonts,
+ * truncate: drawing a 1 KB title that is cut to fit */
+void
+text(void)
+{
+	const char *fonts[] = { "monospace:size=10" };
+	const char *colors[] = { "#bbbbbb", "#222222" };
+	Run r;
+	Drw *drw;
+	long long t0;
+	char *big;
+	size_t n;
+	int i;
+
+	drw = drw_create(dpy, DefaultScreen(dpy), root, 640, 20);
+	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
+		die("kwmbench: no fonts could be loaded");
+	drw_setscheme(drw, drw_scm_create(drw, colors, LENGTH(colors)));
+	/* loading the fallback fonts is a one time cost */
+	for (i = 0; i < LENGTH(titles); i++)
+		drw_text(drw, 0, 0, drw->w, drw->h, 0, titles[i], 0);
+	begin(&r, "text", nops, getpid());
+	for (i = 0; i < nops; i++) {
+		t0 = now();
+		drw_text(drw, 0, 0, drw->w, drw->h, 0, titles[i % LENGTH(titles)], 0);
+		sample(&r, t0);
+	}
+	end(&r);
+
+	big = ecalloc(1024 + 1, 1);
+	for (i = 0; (n = strlen(big)) + strlen(titles[i % LENGTH(titles)]) < 1024; i++)
+		strcpy(big + n, titles[i % LENGTH(titles)]);
+	begin(&r, "truncate", nops, getpid());
+	for (i = 0; i < nops; i++) {
+		t0 = now();
+		drw_text(drw, 0, 0, drw->w, drw->h, 0, big, 0);
+		sample(&r, t0);
+	}
+	end(&r);
+	free(big);
+	free(drw->scheme);
+	drw_fontset_free(drw->fonts);
+	drw_free(drw);
+}
+
+/* whether to run the scenario, all of them run without -s */
+int
+want(const char *name)
+{
+	return !only || !strcmp(only, name);
+}
+
+void
+usage(void)
+{
+	die("usage: kwmbench -p pid [-n windows] [-o ops] [-r ops per second] [-s scenario] [-l kwm stderr]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	Run r;
+	XEvent ev;
+	XWindowAttributes wa;
+	Window focus0, focus1, *list0, *list1;
+	long long t0;
+	int i, j, on, ok, n0, n1, lost, fd, sw, sh, ev0, err0, maj, min;
+	unsigned char batch[BATCH];
+	char title[64];
+
+	for (i = 1; i < argc; i++) {
+		if (i + 1 == argc)
+			usage();
+		else if (!strcmp(argv[i], "-p"))
+			kwm = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-n"))
+			nwins = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-o"))
+			nops = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-r"))
+			rate = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s"))
+			only = argv[++i];
+		else if (!strcmp(argv[i], "-l"))
+			statslog = argv[++i];
+		else
+			usage();
+	}
+	if (!kwm || nwins < 2 || nops < 1)
+		usage();
+	if (!(dpy = XOpenDisplay(NULL)))
+		die("kwmbench: cannot open display");
+	if (!XTestQueryExtension(dpy, &ev0, &err0, &maj, &min))
+		die("kwmbench: no XTest extension");
+	root = DefaultRootWindow(dpy);
+	sw = DisplayWidth(dpy, DefaultScreen(dpy));
+	sh = DisplayHeight(dpy, DefaultScreen(dpy));
+	netwmstate = XInternAtom(dpy, "_NET_WM_STATE", False);
+	netwmfullscreen = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
+	netwmname = XInternAtom(dpy, "_NET_WM_NAME", False);
+	utf8string = XInternAtom(dpy, "UTF8_STRING", False);
+	netclientlist = XInternAtom(dpy, "_NET_CLIENT_LIST", False);
+	wins = ecalloc(nwins, sizeof(Window));
+	for (i = 0; i < 100 && !wmcheck(); i++)
+		usleep(50000);
+	if (!wmcheck())
+		die("kwmbench: kwm is not running");
+
+	/* map: a new window is focused */
+	begin(&r, "map", nwins, kwm);
+	for (i = 0; i < nwins; i++) {
+		wins[i] = createwin();
+		t0 = now();
+		XMapWindow(dpy, wins[i]);
+		XFlush(dpy);
+		sample(&r, waitevent(wins[i], FocusIn, &ev) ? t0 : -1);
+		pace(t0);
+	}
+	end(&r);
+
+	/* chord: C-t n focuses the next client */
+	if (want("chord")) {
+		begin(&r, "chord", nops, kwm);
+		for (i = 0; i < nops; i++) {
+			t0 = now();
+			chord(XK_t, XK_n);
+			sample(&r, waitevent(None, FocusIn, &ev) ? t0 : -1);
+			pace(t0);
+		}
+		end(&r);
+	}
+
+	/* ipc: one command per message, then BATCH of them, up to the reply */
+	if (want("ipc") && (fd = ipcconnect()) >= 0) {
+		memset(batch, IpcNextClient, sizeof(batch));
+		begin(&r, "ipc", nops, kwm);
+		for (i = 0; i < nops; i++) {
+			t0 = now();
+			sample(&r, ipcrequest(fd, batch, 1) ? t0 : -1);
+			pace(t0);
+		}
+		end(&r);
+		n0 = MAX(nops / 10, 1);
+		begin(&r, "ipc_batch", n0, kwm);
+		for (i = 0; i < n0; i++) {
+			t0 = now();
+			sample(&r, ipcrequest(fd, batch, sizeof(batch)) ? t0 : -1);
+			pace(t0);
+		}
+		end(&r);
+		close(fd);
+		/* the focus changes are not waited for by what follows */
+		XSync(dpy, True);
+		XGetInputFocus(dpy, &focused, &j);
+	}
+
+	/* title: nothing to wait for, so only the CPU time tells */
+	if (want("title")) {
+		begin(&r, "title", nops, kwm);
+		for (i = 0; i < nops; i++) {
+			t0 = now();
+			snprintf(title, sizeof(title), "kwmbench %d", i);
+			XChangeProperty(dpy, wins[i % nwins], netwmname, utf8string, 8,
+				PropModeReplace, (unsigned char *)title, strlen(title));
+			XFlush(dpy);
+			r.ops++;
+			pace(t0);
+		}
+		end(&r);
+	}
+
+	/* fullscreen: the window is resized to the screen and back */
+	if (want("fullscreen")) {
+		begin(&r, "fullscreen", nops, kwm);
+		for (i = 0; i < nops; i++) {
+			t0 = now();
+			on = !(i % 2);
+			setfullscreen(wins[0], on);
+			do
+				ok = waitevent(wins[0], ConfigureNotify, &ev);
+			while (ok && (ev.xconfigure.width == sw && ev.xconfigure.height == sh) != on);
+			sample(&r, ok ? t0 : -1);
+			pace(t0);
+		}
+		end(&r);
+	}
+
+	if (want("split")) {
+		split();
+		XGetInputFocus(dpy, &focused, &j);
+	}
+
+	/* restart: kwm execs itself and takes the windows back, which it
+	 * has done once it lists them again */
+	if (want("restart") && getenv("KWM_SOCKET")) {
+		setfullscreen(wins[0], 1);
+		do
+			ok = waitevent(wins[0], ConfigureNotify, &ev);
+		while (ok && (ev.xconfigure.width != sw || ev.xconfigure.height != sh));
+		XSelectInput(dpy, root, PropertyChangeMask);
+		begin(&r, "restart", RESTARTS, kwm);
+		for (i = lost = 0; i < RESTARTS; i++) {
+			/* no list written before the restart may count */
+			settle(kwm);
+			XSync(dpy, True);
+			n0 = clientlist(&list0);
+			XGetInputFocus(dpy, &focus0, &j);
+			t0 = now();
+			ok = ipcrestart();
+			while (ok && (ok = waitevent(root, PropertyNotify, &ev))
+			&& (ev.xproperty.atom != netclientlist || ev.xproperty.state != PropertyNewValue));
+			sample(&r, ok ? t0 : -1);
+			n1 = clientlist(&list1);
+			XGetInputFocus(dpy, &focus1, &j);
+			if (!XGetWindowAttributes(dpy, wins[0], &wa) || wa.width != sw || wa.height != sh
+			|| n1 != n0 || (n0 && memcmp(list0, list1, n0 * sizeof(Window))) || focus1 != focus0)
+				lost++;
+			XFree(list0);
+			XFree(list1);
+			pace(t0);
+		}
+		end(&r);
+		printf("restart_mismatches=%d\n", lost);
+		fflush(stdout);
+		XSelectInput(dpy, root, NoEventMask);
+	}
+
+	if (want("configure")) {
+		configure();
+		XGetInputFocus(dpy, &focused, &j);
+	}
+
+	if (want("reconfigure")) {
+		reconfigure();
+		XGetInputFocus(dpy, &focused, &j);
+	}
+
+	/* unmap: destroying the focused window focuses another one */
+	if (want("unmap")) {
+		begin(&r, "unmap", nwins - 1, kwm);
+		for (i = 0; i < nwins - 1; i++) {
+			for (j = 0; j < nwins && wins[j] != focused; j++);
+			if (j == nwins)
+				break;
+			t0 = now();
+			XDestroyWindow(dpy, wins[j]);
+			wins[j] = None;
+			XFlush(dpy);
+			sample(&r, waitevent(None, FocusIn, &ev) ? t0 : -1);
+			pace(t0);
+		}
+		end(&r);
+	}
+
+	for (i = 0; i < nwins; i++)
+		if (wins[i])
+			XDestroyWindow(dpy, wins[i]);
+	free(wins);
+	if (want("pixmap")) {
+		printf("kwm_pixmap_bytes=%lu\n", pixmapbytes());
+		fflush(stdout);
+	}
+
+	if (want("text"))
+		text();
+	XCloseDisplay(dpy);
+	return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Runs kwm on a headless Xvfb and drives it with kwmbench, which prints
+# one line of results per scenario. Arguments go to kwmbench. The split
+# scenario runs again alone on a 4K screen, and reconfigure with 50
+# windows. kwm's stderr is shown after each run.
+#   BENCHDISPLAY  display to use, :99 by default
+#   BENCHSCREEN   screen geometry, 1920x1080x24 by default
+
+display=${BENCHDISPLAY:-:99}
+screen=${BENCHSCREEN:-1920x1080x24}
+# kwmbench restarts kwm through its socket
+export DISPLAY=$display KWM_SOCKET=/tmp/kwmbench$$.sock
+# kwmbench reads the statistics kwm prints here
+log=/tmp/kwmbench$$.log
+trap 'kill $kwm $xvfb 2>/dev/null; rm -f $log' EXIT INT TERM
+
+# runs kwm on a fresh Xvfb of the geometry given first, then kwmbench
+# with the other arguments
+bench() {
+	Xvfb "$display" -screen 0 "$1" -nolisten tcp 2>/dev/null &
+	xvfb=$!
+	shift
+	# wait for the server socket
+	n=0
+	while [ ! -S "/tmp/.X11-unix/X${display#:}" ] && [ $n -lt 50 ]; do
+		sleep 0.1
+		n=$((n + 1))
+	done
+	./kwm 2>"$log" &
+	kwm=$!
+	./kwmbench -p $kwm -l "$log" "$@"
+	kill $kwm $xvfb 2>/dev/null
+	wait $kwm $xvfb 2>/dev/null
+	cat "$log" >&2
+}
+
+bench "$screen" "$@"
+echo "screen=3840x2160"
+bench 3840x2160x24 "$@" -s split
+echo "screen=${screen%x*}"
+bench "$screen" "$@" -n 50 -s reconfigure
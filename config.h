@@ -10,6 +10,13 @@ static const char *chgcmd[]   = {"dmenu", "-l", "10", NULL};
 static const char *emacs[]    = {"emacs",  NULL, NULL, NULL, "Emacs" };
 static const char *browser[]  = {"firefox", NULL, NULL, NULL, "Firefox-esr" };
 static const int borderpx     = 2;
+static const int framemin     = 64; /* smallest side of a frame in pixels */
+static const unsigned int hotplugdelay = 200; /* ms for RandR events to settle */
+static const int showbar      = 1; /* 0 means no mode line */
+static const int topbar       = 1; /* 0 means the mode line is at the bottom */
+static const unsigned int bardelay = 50; /* ms between mode line redraws at most */
+static const unsigned int statusinterval = 1000; /* ms between clock and load updates */
+static const char clockfmt[]  = "%a %d %b %H:%M"; /* strftime(3) */
 
 /* Colors */
 static const char col_gray1[]       = "#222222";
@@ -23,6 +30,20 @@ static const char *colors[][3]      = {
 	[SchemeSel]  = { col_gray4, col_cyan,  col_cyan  },
 };
 
+/* C-t Tab Tab ... keeps cycling, any other key ends the chord */
+static Keys cyclekeys = {
+	&cyclekeys,
+	NULL,
+	{NOMODIFIER, XK_Tab, cyclehistory, {.i = +1}}
+};
+
+/* C-t r then arrow keys resizes the selected frame until another key */
+static Keys resizekeys[] = {
+	{resizekeys, &resizekeys[1], {NOMODIFIER, XK_Left, hresize, {.i = -16}}},
+	{resizekeys, &resizekeys[2], {NOMODIFIER, XK_Right, hresize, {.i = +16}}},
+	{resizekeys, &resizekeys[3], {NOMODIFIER, XK_Up, vresize, {.i = -16}}},
+	{resizekeys, NULL, {NOMODIFIER, XK_Down, vresize, {.i = +16}}},
+};
 
 static Keys keys = {
 	&(Keys)
@@ -55,17 +76,44 @@ static Keys keys = {
 		     {NULL,
 		      &(Keys)
 		      {NULL,
-		       NULL,
-		       {NOMODIFIER, XK_k, stopclient, {0}}}, /* C-t k */
-		      {NOMODIFIER, XK_quotedbl, changeclient, {0}}}, /* C-t " */
-		     {LEADERMOD, XK_f, runorraise, {.v = browser}}}, /* C-t C-f */
-		    {LEADERMOD, XK_e, runorraise, {.v = emacs}}}, /* C-t C-e */
-		   {LEADERMOD, XK_t, selclient, {0}}}, /* C-t C-t */
-		  ShiftMask, XK_o, prevframe, {0}}, /* C-t O */
-		 {NOMODIFIER, XK_o, nextframe, {0}}}, /* C-t o */
-		{NOMODIFIER, XK_p, prevclient, {0}}}, /* C-t p */
-	       {NOMODIFIER, XK_n, nextclient, {0}}}, /* C-t n */
-	      {ShiftMask, XK_k, killclient, {0}}}, /* C-t K */
+		       &(Keys)
+		       {NULL,
+			&(Keys)
+			{&cyclekeys,
+			 &(Keys)
+			 {NULL,
+			  &(Keys)
+			  {NULL,
+			   &(Keys)
+			   {NULL,
+			    &(Keys)
+			    {NULL,
+			     &(Keys)
+			     {NULL,
+			      &(Keys)
+			      {NULL,
+			       &(Keys)
+			       {resizekeys,
+				NULL,
+				{NOMODIFIER, XK_r, NULL, {0}}}, /* C-t r */
+			       {ShiftMask, XK_r, removeframe, {0}}}, /* C-t R */
+			      {ShiftMask, XK_s, hsplit, {0}}}, /* C-t S */
+			     {NOMODIFIER, XK_s, vsplit, {0}}}, /* C-t s */
+			    {NOMODIFIER, XK_3, jumpclient, {.i = 3}}}, /* C-t 3 */
+			   {NOMODIFIER, XK_2, jumpclient, {.i = 2}}}, /* C-t 2 */
+			  {NOMODIFIER, XK_1, jumpclient, {.i = 1}}}, /* C-t 1 */
+			 {NOMODIFIER, XK_Tab, cyclehistory, {.i = +1}}}, /* C-t Tab */
+			{NOMODIFIER, XK_k, stopclient, {0}}}, /* C-t k */
+		       {NOMODIFIER, XK_quotedbl, changeclient, {.v = chgcmd}}}, /* C-t " */
+		      {LEADERMOD, XK_f, runorraise, {.v = browser}}}, /* C-t C-f */
+		     {LEADERMOD, XK_e, runorraise, {.v = emacs}}}, /* C-t C-e */
+		    {LEADERMOD, XK_t, jumpclient, {.i = 1}}}, /* C-t C-t */
+		   {ShiftMask, XK_o, prevframe, {0}}}, /* C-t O */
+		  {NOMODIFIER, XK_o, nextframe, {0}}}, /* C-t o */
+		 {NOMODIFIER, XK_p, prevclient, {0}}}, /* C-t p */
+		{NOMODIFIER, XK_n, nextclient, {0}}}, /* C-t n */
+	       {ShiftMask, XK_k, killclient, {0}}}, /* C-t K */
+	      {ShiftMask, XK_q, restart, {0}}}, /* C-t Q */
 	     {NOMODIFIER, XK_q, quit, {0}}}, /* C-t q */
 	    {LEADERMOD, XK_g, toggleleader, {.i = 0}}}, /* C-t C-g */
 	   {NOMODIFIER, XK_b, banish, {0}}}, /* C-t b */
@@ -14,18 +14,37 @@ X11LIB = /usr/X11R6/lib
 XINERAMALIBS  = -lXinerama
 XINERAMAFLAGS = -DXINERAMA
 
+# XRandR, comment if you don't want monitor hotplug
+XRANDRLIBS  = -lXrandr
+XRANDRFLAGS = -DXRANDR
+
+# statistics, uncomment to count syncs and other per-event work and to
+# time handlers and commands and count their X requests, round trips and
+# bytes, printed on SIGUSR1 and at exit; SIGUSR2 traces the requests of
+# the next command
+#STATSFLAGS = -DSTATS
+
+# debugging, uncomment to poison freed Client and Monitor slots
+#DEBUGFLAGS = -DSLABDEBUG
+
 # freetype
 FREETYPELIBS = -lfontconfig -lXft
 FREETYPEINC = /usr/include/freetype2
 # OpenBSD (uncomment)
 #FREETYPEINC = ${X11INC}/freetype2
 
+# xcb, used to pipeline requests that need replies
+XCBLIBS = -lX11-xcb -lxcb
+
+# XTest, X-Resource and XRandR, only for kwmbench (make bench)
+BENCHLIBS = -lXtst -lXRes -lXrandr
+
 # includes and libs
 INCS = -I${X11INC} -I${FREETYPEINC}
-LIBS = -L${X11LIB} -lX11 ${XINERAMALIBS} ${FREETYPELIBS}
+LIBS = -L${X11LIB} -lX11 ${XINERAMALIBS} ${XRANDRLIBS} ${FREETYPELIBS} ${XCBLIBS}
 
 # flags
-CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_POSIX_C_SOURCE=2 -DVERSION=\"${VERSION}\" ${XINERAMAFLAGS}
+CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_POSIX_C_SOURCE=2 -DVERSION=\"${VERSION}\" ${XINERAMAFLAGS} ${XRANDRFLAGS} ${STATSFLAGS} ${DEBUGFLAGS}
 CFLAGS   = -g -std=c99 -pedantic -Wall -O0 ${INCS} ${CPPFLAGS}
 #CFLAGS   = -std=c99 -pedantic -Wall -Wno-deprecated-declarations -Os ${INCS} ${CPPFLAGS}
 LDFLAGS  = -s ${LIBS}
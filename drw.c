@@ -10,6 +10,19 @@
 
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
+#define LATIN1      0x100
+#define BMP         0x10000
+#define NOFONT      0xFF /* no font has the glyph, not even a fallback */
+#define MAXFONTS    (NOFONT - 1)
+
+/* Maps codepoints to the index of the font in the set that draws them,
+ * plus one, so 0 means not looked up yet. The BMP gets a flat table,
+ * the rest of the planes an open addressed hash. */
+struct FntCache {
+	unsigned char bmp[BMP];
+	struct { unsigned int cp; unsigned char font; } *ext;
+	size_t size, used; /* of ext, size is a power of two */
+};
 
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -70,13 +83,14 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->root = root;
 	drw->w = w;
 	drw->h = h;
-	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
 	return drw;
 }
 
+/* Sets the size of what is drawn next, the pixmap is picked when
+ * drawing starts. */
 void
 drw_resize(Drw *drw, unsigned int w, unsigned int h)
 {
@@ -85,15 +99,62 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 
 	drw->w = w;
 	drw->h = h;
+	drw->drawable = None;
+	drw->xftdraw = NULL;
+}
+
+static void
+surf_free(Drw *drw, Surf *s)
+{
+	if (!s->pixmap)
+		return;
+	XftDrawDestroy(s->xftdraw);
+	XFreePixmap(drw->dpy, s->pixmap);
+}
+
+/* Draws to the smallest pixmap of the pool that holds w x h, or else
+ * replaces the one that was bound least recently with a new one of that
+ * size. Its XftDraw lives as long as it does. */
+static void
+drw_bind(Drw *drw)
+{
+	Surf *s, *fit = NULL, *lru = &drw->pool[0];
+	unsigned int w = MAX(drw->w, 1), h = MAX(drw->h, 1);
+	size_t i;
+
 	if (drw->drawable)
-		XFreePixmap(drw->dpy, drw->drawable);
-	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+		return;
+	for (i = 0; i < DRW_POOL; i++) {
+		s = &drw->pool[i];
+		if (s->pixmap && s->w >= w && s->h >= h
+		&& (!fit || s->w * s->h < fit->w * fit->h))
+			fit = s;
+		if (s->used < lru->used)
+			lru = s;
+	}
+	if (!(s = fit)) {
+		s = lru;
+		surf_free(drw, s);
+		s->w = w;
+		s->h = h;
+		s->pixmap = XCreatePixmap(drw->dpy, drw->root, w, h,
+		                          DefaultDepth(drw->dpy, drw->screen));
+		s->xftdraw = XftDrawCreate(drw->dpy, s->pixmap,
+		                           DefaultVisual(drw->dpy, drw->screen),
+		                           DefaultColormap(drw->dpy, drw->screen));
+	}
+	s->used = ++drw->tick;
+	drw->drawable = s->pixmap;
+	drw->xftdraw = s->xftdraw;
 }
 
 void
 drw_free(Drw *drw)
 {
-	XFreePixmap(drw->dpy, drw->drawable);
+	size_t i;
+
+	for (i = 0; i < DRW_POOL; i++)
+		surf_free(drw, &drw->pool[i]);
 	XFreeGC(drw->dpy, drw->gc);
 	free(drw);
 }
@@ -167,6 +228,8 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 			ret = cur;
 		}
 	}
+	if (ret)
+		ret->cache = ecalloc(1, sizeof(struct FntCache));
 	return (drw->fonts = ret);
 }
 
@@ -175,8 +238,159 @@ drw_fontset_free(Fnt *font)
 {
 	if (font) {
 		drw_fontset_free(font->next);
+		if (font->cache) {
+			free(font->cache->ext);
+			free(font->cache);
+		}
+		xfont_free(font);
+	}
+}
+
+static size_t
+cache_slot(struct FntCache *c, long cp)
+{
+	size_t i;
+
+	for (i = (cp * 2654435761u) & (c->size - 1); c->ext[i].cp && c->ext[i].cp != cp;
+	     i = (i + 1) & (c->size - 1))
+		; /* NOP */
+	return i;
+}
+
+static int
+cache_get(struct FntCache *c, long cp)
+{
+	if (cp < BMP)
+		return c->bmp[cp];
+	return c->size ? c->ext[cache_slot(c, cp)].font : 0;
+}
+
+static void
+cache_put(struct FntCache *c, long cp, int font)
+{
+	struct FntCache old;
+	size_t i;
+
+	if (cp < BMP) {
+		c->bmp[cp] = font;
+		return;
+	}
+	if (4 * (c->used + 1) > 3 * c->size) {
+		old.ext = c->ext;
+		old.size = c->size;
+		c->size = c->size ? 2 * c->size : 64;
+		c->ext = ecalloc(c->size, sizeof(*c->ext));
+		for (i = 0; i < old.size; i++)
+			if (old.ext[i].cp)
+				c->ext[cache_slot(c, old.ext[i].cp)] = old.ext[i];
+		free(old.ext);
+	}
+	i = cache_slot(c, cp);
+	if (!c->ext[i].cp) {
+		c->ext[i].cp = cp;
+		c->used++;
+	}
+	c->ext[i].font = font;
+}
+
+/* A new fallback font may draw what nothing could before. Forgotten
+ * hash entries keep their key so that probing still passes them. */
+static void
+cache_dropmisses(struct FntCache *c)
+{
+	size_t i;
+
+	for (i = 0; i < BMP; i++)
+		if (c->bmp[i] == NOFONT)
+			c->bmp[i] = 0;
+	for (i = 0; i < c->size; i++)
+		if (c->ext[i].font == NOFONT)
+			c->ext[i].font = 0;
+}
+
+/* Loads a fallback font for the codepoint and appends it to the set,
+ * returns NULL when there is none. */
+static Fnt *
+fallback(Drw *drw, long cp)
+{
+	Fnt *font, *last;
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+	FcPattern *match;
+	XftResult result;
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, cp);
+
+	fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+
+	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+	match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
+
+	if (!match)
+		return NULL;
+	font = xfont_create(drw, NULL, match);
+	if (!font || !XftCharExists(drw->dpy, font->xfont, cp)) {
 		xfont_free(font);
+		return NULL;
+	}
+	for (last = drw->fonts; last->next; last = last->next)
+		; /* NOP */
+	last->next = font;
+	cache_dropmisses(drw->fonts->cache);
+	return font;
+}
+
+/* Width of the glyph, Latin-1 ones are looked up once per font. */
+static unsigned int
+advance(Fnt *font, long cp)
+{
+	XGlyphInfo ext;
+	FcChar32 c = cp;
+
+	if (cp < LATIN1 && font->adv[cp])
+		return font->adv[cp] - 1;
+	XftTextExtents32(font->dpy, font->xfont, &c, 1, &ext);
+	if (cp < LATIN1)
+		font->adv[cp] = ext.xOff + 1;
+	return ext.xOff;
+}
+
+/* The font of the set that draws the codepoint, the first one when none
+ * does. Only the first lookup of a codepoint asks Xft. */
+static Fnt *
+getfont(Drw *drw, long cp)
+{
+	struct FntCache *c = drw->fonts->cache;
+	Fnt *font;
+	int i;
+
+	if ((i = cache_get(c, cp)) == NOFONT)
+		return drw->fonts;
+	if (i--) {
+		for (font = drw->fonts; i--; font = font->next)
+			; /* NOP */
+		return font;
 	}
+	for (font = drw->fonts, i = 0; font; font = font->next, i++)
+		if (XftCharExists(drw->dpy, font->xfont, cp))
+			break;
+	if (!font)
+		font = fallback(drw, cp); /* appended as font i */
+	if (i < MAXFONTS)
+		cache_put(c, cp, font ? i + 1 : NOFONT);
+	return font ? font : drw->fonts;
 }
 
 void
@@ -228,6 +442,7 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 {
 	if (!drw || !drw->scheme)
 		return;
+	drw_bind(drw);
 	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
 	if (filled)
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
@@ -238,20 +453,12 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
-	char buf[1024];
-	int ty;
-	unsigned int ew;
-	XftDraw *d = NULL;
+	int ty, ellipsis_x = 0;
+	unsigned int tmpw, ew, ellipsis_w = 0, ellipsis_len, ellipsis_width = 0;
 	Fnt *usedfont, *curfont, *nextfont;
-	size_t i, len;
-	int utf8strlen, utf8charlen, render = x || y || w || h;
+	int utf8strlen, utf8charlen, render = x || y || w || h, overflow = 0;
 	long utf8codepoint = 0;
 	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	XftResult result;
-	int charexists = 0;
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
@@ -259,108 +466,58 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	if (!render) {
 		w = ~w;
 	} else {
+		drw_bind(drw);
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
 		x += lpad;
 		w -= lpad;
+		ellipsis_width = 3 * advance(getfont(drw, '.'), '.');
 	}
 
 	usedfont = drw->fonts;
 	while (1) {
-		utf8strlen = 0;
+		ew = ellipsis_len = utf8strlen = 0;
 		utf8str = text;
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
+			if ((curfont = getfont(drw, utf8codepoint)) != usedfont) {
+				nextfont = curfont;
+				break;
 			}
-
-			if (!charexists || nextfont)
+			tmpw = advance(curfont, utf8codepoint);
+			if (ew + ellipsis_width <= w) {
+				/* keep track of where the ellipsis still fits */
+				ellipsis_x = x + ew;
+				ellipsis_w = w - ew;
+				ellipsis_len = utf8strlen;
+			}
+			if (ew + tmpw > w) {
+				overflow = 1;
+				utf8strlen = ellipsis_len;
 				break;
-			else
-				charexists = 0;
+			}
+			utf8strlen += utf8charlen;
+			text += utf8charlen;
+			ew += tmpw;
 		}
 
-		if (utf8strlen) {
-			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
-
-			if (len) {
-				memcpy(buf, utf8str, len);
-				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
-
-				if (render) {
-					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
-				}
-				x += ew;
-				w -= ew;
-			}
+		if (utf8strlen && render) {
+			ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
+			XftDrawStringUtf8(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
+			                  usedfont->xfont, x, ty, (XftChar8 *)utf8str, utf8strlen);
 		}
+		x += ew;
+		w -= ew;
 
-		if (!*text) {
+		if (overflow) {
+			drw_text(drw, ellipsis_x, y, ellipsis_w, h, 0, "...", invert);
 			break;
-		} else if (nextfont) {
-			charexists = 0;
-			usedfont = nextfont;
-		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
-
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
-				}
-			}
 		}
+		if (!*text)
+			break;
+		usedfont = nextfont;
 	}
-	if (d)
-		XftDrawDestroy(d);
 
 	return x + (render ? w : 0);
 }
@@ -371,16 +528,37 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 	if (!drw)
 		return;
 
+	drw_bind(drw);
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
 }
 
 unsigned int
 drw_fontset_getwidth(Drw *drw, const char *text)
 {
-	if (!drw || !drw->fonts || !text)
-		return 0;
-	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	return drw_fontset_getwidth_clamp(drw, text, ~0U, NULL);
+}
+
+/* Measures without drawing. Stops at the first character that would
+ * make the text wider than n and stores the length in bytes of what
+ * fits in len. */
+unsigned int
+drw_fontset_getwidth_clamp(Drw *drw, const char *text, unsigned int n, size_t *len)
+{
+	const char *p = text;
+	unsigned int w = 0, cw;
+	long cp;
+	size_t cl;
+
+	if (drw && drw->fonts && text) {
+		for (; *p; p += cl, w += cw) {
+			cl = utf8decode(p, &cp, UTF_SIZ);
+			if ((cw = advance(getfont(drw, cp), cp)) > n - w)
+				break;
+		}
+	}
+	if (len)
+		*len = p - text;
+	return w;
 }
 
 void
@@ -8,20 +8,34 @@ typedef struct Fnt {
 	XftFont *xfont;
 	FcPattern *pattern;
 	struct Fnt *next;
+	struct FntCache *cache; /* codepoint to font, on the first font of a set */
+	unsigned short adv[0x100]; /* Latin-1 glyph widths plus one, 0 when not known yet */
 } Fnt;
 
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
+typedef struct {
+	unsigned int w, h;
+	Pixmap pixmap;
+	XftDraw *xftdraw;
+	unsigned long used; /* when last bound, 0 while the slot is free */
+} Surf;
+
+#define DRW_POOL 4 /* pixmaps kept around for reuse */
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
 	int screen;
 	Window root;
-	Drawable drawable;
+	Drawable drawable; /* None until something is drawn at this size */
+	XftDraw *xftdraw;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	Surf pool[DRW_POOL];
+	unsigned long tick;
 } Drw;
 
 /* Drawable abstraction */
@@ -33,6 +47,7 @@ void drw_free(Drw *drw);
 Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt* set);
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
+unsigned int drw_fontset_getwidth_clamp(Drw *drw, const char *text, unsigned int n, size_t *len);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
 /* Colorscheme abstraction */
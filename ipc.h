@@ -0,0 +1,54 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * kwm IPC protocol
+ *
+ * kwm listens on a SOCK_SEQPACKET unix socket, at $KWM_SOCKET when set,
+ * else at $XDG_RUNTIME_DIR/kwm<display>.sock (or in /tmp/kwm-<uid>,
+ * private to the user, when unset), and exports the path it uses as
+ * KWM_SOCKET to the programs it starts.
+ *
+ * A request message is any number of commands back to back, in host
+ * byte order and without padding. Each command is an opcode byte
+ * followed by its operands:
+ *
+ *   IpcFocus         uint32_t window
+ *   IpcNextClient    -
+ *   IpcPrevClient    -
+ *   IpcKillClient    -
+ *   IpcNextFrame     -
+ *   IpcSpawn         uint16_t len, then len bytes of argv, each
+ *                    argument NUL terminated
+ *   IpcRunOrRaise    uint16_t len, then len bytes: the WM_CLASS class
+ *                    and the argv to spawn, each NUL terminated
+ *   IpcSubscribe     uint8_t mask of IpcEv* to push from now on
+ *   IpcRestart       -, answered before kwm execs itself, which closes
+ *                    the connection
+ *
+ * The commands of a message run in order, and kwm answers every message
+ * with a single IpcMsg of type IpcReply. Its arg holds the number of
+ * commands run, and its status is IpcBadCommand if it stopped at one it
+ * could not decode.
+ * An empty message runs no commands and is answered like any other,
+ * unless the client has shut down its end, after which kwm cannot tell
+ * one from the hangup.
+ *
+ * Subscribed events arrive as IpcMsg messages with type set to the
+ * IpcEv* bit and arg set to the window. Events are dropped rather than
+ * queued for subscribers that don't keep up.
+ */
+
+#define IPCMSGMAX 65536 /* largest request message */
+
+enum { IpcFocus, IpcNextClient, IpcPrevClient, IpcKillClient,
+       IpcNextFrame, IpcSpawn, IpcRunOrRaise, IpcSubscribe,
+       IpcRestart }; /* opcodes */
+enum { IpcEvFocus = 1 << 0, IpcEvMap = 1 << 1, IpcEvUnmap = 1 << 2 }; /* events */
+enum { IpcReply = 0 }; /* message types besides events */
+enum { IpcOk, IpcBadCommand }; /* reply status */
+
+typedef struct {
+	uint8_t type;
+	uint8_t status;
+	uint16_t pad;
+	uint32_t arg;
+} IpcMsg;
@@ -2,21 +2,40 @@
 #include <unistd.h>
 #include <X11/Xft/Xft.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xproto.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <xcb/xcb.h>
+#ifdef STATS
+#include <X11/Xlibint.h> /* for the output buffer, to count bytes */
+#endif /* STATS */
 #ifdef XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif /* XINERAMA */
+#ifdef XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif /* XRANDR */
 
 #include "util.h"
 #include "drw.h"
+#include "ipc.h"
 
 
 
@@ -29,18 +48,46 @@
 #define WIDTH(X)                ((X)->w + 2 * (X)->bw)
 #define HEIGHT(X)               ((X)->h + 2 * (X)->bw)
 #define ColBorder               2
+#define TICKMS                  10   /* timer wheel resolution */
+#define TEXTW(X)                (drw_fontset_getwidth(drw, (X)) + lrpad)
+#ifdef STATS
+#define STAT(X)                 (stats.X++)
+#define PROBE(P, X)             do { Probe *p_ = (P); Snap s_; snapshot(&s_); X; account(p_, &s_); } while (0)
+#define ROUNDTRIP(X)            (roundtrip(#X), (X))
+#define SENT(SEQ, NAME)         sent(SEQ, NAME)
+#else
+#define STAT(X)
+#define PROBE(P, X)             X
+#define ROUNDTRIP(X)            (X)
+#define SENT(SEQ, NAME)
+#endif /* STATS */
+#define HISTSUB                 3  /* log2 of the buckets per power of two */
+#define HISTPOW                 40 /* powers of two of ns kept, ~18 minutes */
+#define STATEMAGIC              0x6b776d02 /* "kwm" and the _KWM_STATE version */
+#define STATEMAX                (1 << 22)  /* longest _KWM_STATE read, in bytes */
+#define STATEDEPTH              64         /* deepest frame tree read back */
 
 /* Enums */
 enum { NetSupported, NetWMName, NetWMState, NetWMCheck,
        NetWMFullscreen, NetActiveWindow, NetWMWindowType,
-       NetWMWindowTypeDialog, NetClientList, NetLast }; /* EWMH atoms */
+       NetWMWindowTypeDialog, NetClientList, NetClientListStacking,
+       NetLast }; /* EWMH atoms */
 enum { WMProtocols, WMDelete, WMState, WMTakeFocus, WMLast }; /* default atoms */
 enum { CurNormal, CurLeaderKey, CurResize, CurMove, CurLast }; /* cursor */
 enum { SchemeNorm, SchemeSel }; /* color schemes */
+enum { SplitNone, SplitH, SplitV }; /* frame splits, SplitH is side by side */
+enum { SegFrame, SegTitle, SegLoad, SegClock, SegLast }; /* mode line, left to right */
+enum { PropNetWMName, PropWMName, PropTransient, PropNetWMState,
+       PropWindowType, PropWMHints, PropWMProtocols, PropWMClass,
+       PropLast }; /* adoption */
+enum { StaleTitle = 1 << 0, StaleHints = 1 << 1, StaleProtocols = 1 << 2,
+       StaleType = 1 << 3 }; /* fields whose property changed */
 
 /* Data structures */
 typedef struct Client  Client;
 typedef struct Monitor Monitor;
+typedef struct Class   Class;
+typedef struct Frame   Frame;
 
 
 struct Client {
@@ -51,20 +98,66 @@ struct Client {
 	int basew, baseh, incw, inch, maxw, maxh, minw, minh;
 	int bw, oldbw;
 	int isfixed, isfloating, isurgent, neverfocus, oldstate, isfullscreen;
-	Client *next, *snext;
+	unsigned int protocols; /* bit per supported wmatom */
+	unsigned int stale; /* Stale* fields to reread before use */
+	Client *next;
+	Client *hprev, *hnext; /* global focus history, most recent first */
+	Client *sprev, *snext; /* focus history of mon */
+	Client *cprev, *cnext; /* clients of the same class */
+	Client *fnext; /* clients of the same frame */
+	Class *cls;
+	Frame *frame;
 	Monitor *mon;
 	Window win;
 };
 
+struct Class {
+	char name[64];    /* res_class of WM_CLASS */
+	Client *clients;  /* most recently focused first */
+	Class *next;
+};
+
+/* a part of the mode line, redrawn and copied on its own */
+typedef struct {
+	int x, w;  /* as last drawn */
+	int dirty;
+} Segment;
+
 struct Monitor {
 	int num;
+	int by;               /* bar geometry */
 	int mx, my, mw, mh;   /* screen size */
 	int wx, wy, ww, wh;   /* window area  */
 	Client *clients;
 	Client *sel;
+	Client *stack; /* most recently focused first */
+	Frame *frames; /* root of the frame tree, covers the window area */
+	Frame *selframe;
+	int dirty;     /* needs a relayout after a geometry change */
+	unsigned long output; /* RandR output or Xinerama screen shown */
+	Window barwin;
+	Segment seg[SegLast];
 	Monitor *next;
 };
 
+/* a monitor as the server reports it */
+typedef struct {
+	unsigned long id;
+	int x, y, w, h;
+} Output;
+
+/* A node of a monitor's frame tree. Leaves hold clients and show the
+ * one last focused, inner nodes split their area between two children. */
+struct Frame {
+	int x, y, w, h;
+	int split;        /* SplitNone for a leaf */
+	float ratio;      /* share of child[0] */
+	Frame *parent, *child[2];
+	Client *clients;  /* leaves only */
+	Client *sel;
+	Monitor *mon;
+};
+
 typedef union {
 	int i;
 	unsigned int ui;
@@ -80,6 +173,67 @@ typedef struct {
 } Key;
 
 
+/* requests for a window being adopted, sent together and collected once */
+typedef struct {
+	Window win;
+	xcb_get_window_attributes_cookie_t attrck;
+	xcb_get_geometry_cookie_t geomck;
+	xcb_get_property_cookie_t propck[PropLast];
+	xcb_get_window_attributes_reply_t *attr;
+	xcb_get_geometry_reply_t *geom;
+	xcb_get_property_reply_t *prop[PropLast];
+} Adoption;
+
+/* requests for the stale fields of a client, see refresh */
+typedef struct {
+	Client *c;
+	unsigned int stale;
+	xcb_get_property_cookie_t propck[PropLast];
+} Refresh;
+
+/* the state restart hands over, written by appending at len and read
+ * by consuming from len up to size */
+typedef struct {
+	unsigned char *p;
+	size_t len, size;
+	int bad; /* a read ran past the end */
+} Blob;
+
+/* a file descriptor the main loop waits on */
+typedef struct Watch Watch;
+struct Watch {
+	int fd;
+	void (*func)(Watch *, unsigned int); /* called with the epoll events */
+};
+
+typedef struct Timer Timer;
+struct Timer {
+	void (*func)(void);
+	unsigned long expires; /* in ticks */
+	long long due;         /* in ns, to measure jitter */
+	Timer *next, **pprev;  /* wheel slot, pprev is NULL when idle */
+};
+
+/* a window selector running in dmenu, fed and read without blocking */
+typedef struct {
+	pid_t pid;
+	Watch in, out;      /* dmenu's stdin and stdout, fd -1 once closed */
+	char *list;         /* lines still to be written */
+	size_t len, off;
+	Window *wins;       /* window of each line, by line number */
+	int nwins;
+	char sel[512];      /* dmenu's answer */
+	size_t nsel;
+} Menu;
+
+/* a connection to the IPC socket, see ipc.h */
+typedef struct IpcClient IpcClient;
+struct IpcClient {
+	Watch watch; /* first, so the Watch callbacks can cast it back */
+	unsigned int events; /* IpcEv* subscriptions */
+	IpcClient *next;
+};
+
 typedef struct Keys Keys;
 
 struct Keys {
@@ -88,20 +242,62 @@ struct Keys {
 	Key key;
 };
 
+/* Each sibling list of the Keys tree becomes a Keymap indexed by
+ * keycode, built once at startup and again on MappingNotify. */
+typedef struct Binding Binding;
+struct Binding {
+	unsigned int mod;
+	Keys *node;
+	int child; /* index into keymaps, -1 ends the chord */
+	Binding *next;
+};
+
+typedef struct {
+	Keys *head;
+	Binding *bindings;
+	Binding *code[256];
+} Keymap;
+
+#ifdef STATS
+/* latencies in ns, bucketed like HdrHistogram: exact below 1 << HISTSUB,
+ * then 1 << HISTSUB buckets per power of two */
+typedef struct {
+	unsigned long n[HISTPOW << HISTSUB];
+	unsigned long count;
+	long long max;
+} Hist;
+
+/* what the handler of an event type or a command cost, see PROBE */
+typedef struct {
+	Hist lat;
+	unsigned long requests, roundtrips, bytes;
+} Probe;
+
+typedef struct {
+	long long t;
+	unsigned long requests, roundtrips, bytes;
+} Snap;
+#endif /* STATS */
+
 
 /* Procedures */
 
 static void unfocus(Client *, int);
 static void clientmessage(XEvent *);
 static void setfullscreen(Client *, int);
-static void updatewindowtype(Client *);
+static void updatewindowtype(Client *, xcb_get_property_reply_t *, xcb_get_property_reply_t *);
 static void unmapnotify(XEvent *);
-static void updatewmhints(Client *);
+static void updatewmhints(Client *, xcb_get_property_reply_t *);
+static void updateprotocols(Client *, xcb_get_property_reply_t *);
 static void attach(Client *);
-static void updatetitle(Client *);
+static void detach(Client *);
+static void updatetitle(Client *, xcb_get_property_reply_t *, xcb_get_property_reply_t *);
 static void maprequest(XEvent *);
 static void unmanage(Client *, int);
-static void updateclientlist();
+static void updateclientlist(void);
+static void listclient(Client *);
+static void unlistclient(Client *);
+static void raiseclient(Client *);
 static void setclientstate(Client *, long);
 static void checkotherwm();
 static int xerrorstart(Display *, XErrorEvent *);
@@ -109,8 +305,42 @@ static void focusin(XEvent *e);
 static int xerror(Display *, XErrorEvent *);
 static void setup(void);
 static void run(void);
-static void sigchld(int);
+static int supersedes(XEvent *, XEvent *);
+static void coalesce(XEvent *, int);
+static void dispatch(XEvent *, int);
+static void xsync(void);
+static void dumpstats(void);
+#ifdef STATS
+static void histadd(Hist *, long long);
+static long long histquantile(Hist *, double);
+static void probedump(Probe *, const char *);
+static Probe *cmdprobe(void (*)(const Arg *));
+static unsigned long xrequests(void);
+static unsigned long xbytes(void);
+static void snapshot(Snap *);
+static void account(Probe *, Snap *);
+static void roundtrip(const char *);
+static void sent(unsigned int, const char *);
+static void flushhook(Display *, XExtCodes *, const char *, long);
+#endif /* STATS */
+static void childsetup(void);
+static void signals(Watch *, unsigned int);
+static void xevents(Watch *, unsigned int);
+static void watchfd(Watch *, unsigned int);
+static void unwatchfd(Watch *);
+static long long now(void);
+static void armtimer(Timer *, unsigned int);
+static void disarmtimer(Timer *);
+static void timertick(Watch *, unsigned int);
 static int updategeom(void);
+static int getoutputs(Output **);
+static void evacuate(Monitor *, Monitor *);
+static void relayout(void);
+#ifdef XRANDR
+static void rrnotify(XEvent *);
+static void hotplug(void);
+#endif /* XRANDR */
+static void trackpointer(XEvent *);
 static void keypress(XEvent *);
 static Monitor *createmon(void);
 static void cleanupmon(Monitor *);
@@ -118,22 +348,47 @@ static Monitor *wintomon(Window);
 static int getrootptr(int *, int *);
 static Monitor* recttomon(int, int, int, int);
 static Client* wintoclient(Window);
+static unsigned int winhash(Window);
+static void indexclient(Client *);
+static void unindexclient(Client *);
 static void grabkeys(void);
+static int addkeymap(Keys *, KeySym *, int, int, int);
+static void freekeymaps(void);
+static void mappingnotify(XEvent *);
 static void spawn(const Arg *);
 static void toggleleader(const Arg *);
 static void banish(const Arg *);
 static void quit(const Arg *);
+static void restart(const Arg *);
+static void put(Blob *, const void *, size_t);
+static void put32(Blob *, uint32_t);
+static void putstr(Blob *, const char *);
+static void putframe(Blob *, Frame *);
+static void get(Blob *, void *, size_t);
+static uint32_t get32(Blob *);
+static void getstr(Blob *, char *, size_t);
+static Window *getwins(Blob *, uint32_t *);
+static Client *getclient(Blob *, xcb_window_t *, int);
+static Frame *getframe(Blob *, Monitor *, Frame *, Frame *, int, xcb_window_t *, int);
+static void restore(Blob *, xcb_window_t *, int);
 static void cleanup(void);
 static int xerrordummy(Display *, XErrorEvent *);
-static void manage(Window, XWindowAttributes *);
+static void adoptrequest(Adoption *, Window);
+static int adoptreply(Adoption *);
+static void adoptfree(Adoption *);
+static void refreshrequest(Refresh *, Client *, unsigned int);
+static void refreshreply(Refresh *);
+static void refresh(Client *, unsigned int);
+static Client *manage(Adoption *);
+static void scan(void);
 static void resize(Client *, int, int, int, int, int);
 static void resizeclient(Client *c, int x, int y, int w, int h);
 static int applysizehints(Client *, int *, int *, int *, int *, int);
 static void configure(Client *);
-static int sendevent(Client *, Atom);
+static int sendevent(Client *, int);
 static void killclient(const Arg *);
 static void stopclient(const Arg *);
-static int gettextprop(Window, Atom, char *, unsigned int);
+static int gettextprop(xcb_get_property_reply_t *, char *, unsigned int);
 static void focus(Client *);
 static void destroynotify(XEvent *);
 static void nextclient(const Arg *);
@@ -141,18 +396,69 @@ static void prevclient(const Arg *);
 static void configurenotify(XEvent *);
 static void prevframe(const Arg *);
 static void nextframe(const Arg *);
-static void selclient(const Arg *);
+static Frame *createframe(Monitor *);
+static void freeframes(Frame *);
+static void attachframe(Client *, Frame *);
+static void detachframe(Client *);
+static void arrange(Frame *);
+static void placeframe(Frame *, int, int, int, int);
+static void placemon(Monitor *, int, int, int, int);
+static Frame *nextleaf(Frame *, int);
+static void focusframe(Frame *);
+static void splitframe(int);
+static void hsplit(const Arg *);
+static void vsplit(const Arg *);
+static void removeframe(const Arg *);
+static void resizeframe(int, int);
+static void hresize(const Arg *);
+static void vresize(const Arg *);
+static void jumpclient(const Arg *);
+static void cyclehistory(const Arg *);
+static void endcycle(void);
+static void attachstack(Client *);
+static void detachstack(Client *);
+static void promote(Client *);
 static void runorraise(const Arg *);
-static Atom getatomprop(Client *, Atom);
+static void changeclient(const Arg *);
+static void menuwrite(Watch *, unsigned int);
+static void menuread(Watch *, unsigned int);
+static void closemenu(void);
+static void setupipc(void);
+static void ipcaccept(Watch *, unsigned int);
+static void ipcread(Watch *, unsigned int);
+static void ipcexec(IpcClient *, unsigned char *, size_t, IpcMsg *);
+static int ipcargv(unsigned char *, size_t, char **, int);
+static void ipcnotify(unsigned int, Window);
+static void ipcclose(IpcClient *);
+static int raiseclass(const char *);
+static int hasatom(xcb_get_property_reply_t *, Atom);
+static unsigned int classhash(const char *);
+static Class *getclass(const char *, int);
+static void promoteclass(Client *);
+static void attachclass(Client *, const char *);
+static void detachclass(Client *);
+static void updateclass(Client *, xcb_get_property_reply_t *);
+static void propertynotify(XEvent *);
+static void updatebar(Monitor *);
+static void markbar(Monitor *, int);
+static void drawbar(Monitor *);
+static void drawbars(void);
+static void updatestatus(void);
+static void expose(XEvent *);
 static void configurerequest(XEvent *e);
 
 /* Variables */
 
 static Clr **scheme;
 static Display *dpy;
+static xcb_connection_t *xcon;
 static int (*xerrorxlib)(Display *, XErrorEvent *);
 static void (*handler[LASTEvent]) (XEvent *) = {
+	[ButtonPress] = trackpointer,
+	[EnterNotify] = trackpointer,
 	[KeyPress] = keypress,
+	[MotionNotify] = trackpointer,
+	[Expose] = expose,
 	[MapRequest] = maprequest,
 	[UnmapNotify] = unmapnotify,
 	[FocusIn] = focusin,
@@ -160,26 +466,129 @@ static void (*handler[LASTEvent]) (XEvent *) = {
 	[ConfigureNotify] = configurenotify,
 	[ClientMessage] = clientmessage,
 	[ConfigureRequest] = configurerequest,
+	[MappingNotify] = mappingnotify,
+	[PropertyNotify] = propertynotify,
 };
 
 static const char broken[] = "broken";
 static int running = 1;
+static int restarting; /* main execs kwm again once run returns */
 static int screen;
 static int sw, sh;
+static int bh, lrpad; /* mode line height, padding of its texts */
+static char clocktext[64], loadtext[32];
 static Window root, wmcheckwin;
 static Drw *drw;
-static Atom wmatom[WMLast], netatom[NetLast];
+static Atom wmatom[WMLast], netatom[NetLast], utf8string;
+static Atom propatom[PropLast];
+static Atom stateatom; /* _KWM_STATE, see restart */
+/* longest read of each property in 32 bit units, titles are cut to fit */
+static const uint32_t proplen[PropLast] = {
+	[PropNetWMName] = sizeof ((Client *)0)->name / 4,
+	[PropWMName] = sizeof ((Client *)0)->name / 4,
+	[PropTransient] = 1,
+	[PropNetWMState] = 32,
+	[PropWindowType] = 32,
+	[PropWMHints] = 9,
+	[PropWMProtocols] = 32,
+	[PropWMClass] = 2 * sizeof ((Class *)0)->name / 4,
+};
+/* what is reread for each Stale* bit */
+static const struct {
+	unsigned int stale;
+	int prop;
+} staleprops[] = {
+	{ StaleTitle, PropNetWMName }, { StaleTitle, PropWMName },
+	{ StaleHints, PropWMHints }, { StaleProtocols, PropWMProtocols },
+	{ StaleType, PropWindowType },
+};
 static Cur *cursor[CurLast];
 static Monitor *mons, *selmon;
+static Slab *clientslab, *monslab, *frameslab;
 static int pointergrabbed;
+static Keymap *keymaps, *currmap; /* keymaps[0] is the root of the tree */
+static int nkeymaps;
+static unsigned char modcodes[32]; /* bitmap of modifier keycodes */
+static Client **clienttab; /* XID -> Client, open addressing */
+static unsigned int clienttabsz, nclienttab;
+static Window unmanaged[64]; /* recent wintoclient misses, direct mapped */
+static Class *classtab[64]; /* res_class -> clients */
+static Window *clientlist, *stacklist; /* mapping order, bottom to top */
+static int nclientlist, clientlistsz, clientlistdirty;
+#ifdef STATS
+static const char *evname[LASTEvent] = {
+	[KeyPress] = "KeyPress", [KeyRelease] = "KeyRelease",
+	[ButtonPress] = "ButtonPress", [ButtonRelease] = "ButtonRelease",
+	[MotionNotify] = "MotionNotify", [EnterNotify] = "EnterNotify",
+	[LeaveNotify] = "LeaveNotify", [FocusIn] = "FocusIn",
+	[FocusOut] = "FocusOut", [KeymapNotify] = "KeymapNotify",
+	[Expose] = "Expose", [GraphicsExpose] = "GraphicsExpose",
+	[NoExpose] = "NoExpose", [VisibilityNotify] = "VisibilityNotify",
+	[CreateNotify] = "CreateNotify", [DestroyNotify] = "DestroyNotify",
+	[UnmapNotify] = "UnmapNotify", [MapNotify] = "MapNotify",
+	[MapRequest] = "MapRequest", [ReparentNotify] = "ReparentNotify",
+	[ConfigureNotify] = "ConfigureNotify", [ConfigureRequest] = "ConfigureRequest",
+	[GravityNotify] = "GravityNotify", [ResizeRequest] = "ResizeRequest",
+	[CirculateNotify] = "CirculateNotify", [CirculateRequest] = "CirculateRequest",
+	[PropertyNotify] = "PropertyNotify", [SelectionClear] = "SelectionClear",
+	[SelectionRequest] = "SelectionRequest", [SelectionNotify] = "SelectionNotify",
+	[ColormapNotify] = "ColormapNotify", [ClientMessage] = "ClientMessage",
+	[MappingNotify] = "MappingNotify", [GenericEvent] = "GenericEvent",
+};
+#endif /* STATS */
 
 
 /* Configuration file */
 #include "config.h"
 
-static Keys *currkey = &keys;
-
-static Client *lastclient;
+#ifdef STATS
+#define CMD(F) { F, #F }
+static const struct {
+	void (*func)(const Arg *);
+	const char *name;
+} cmdnames[] = {
+	CMD(quit), CMD(toggleleader), CMD(banish), CMD(spawn), CMD(killclient),
+	CMD(stopclient), CMD(nextclient), CMD(prevclient), CMD(nextframe),
+	CMD(prevframe), CMD(jumpclient), CMD(cyclehistory), CMD(runorraise),
+	CMD(changeclient), CMD(hsplit), CMD(vsplit), CMD(removeframe),
+	CMD(hresize), CMD(vresize), CMD(restart),
+	{ NULL, "other" }, /* last, counts whatever is missing above */
+};
+static struct {
+	unsigned long events, syncs;
+	unsigned long coalesced[LASTEvent];
+	unsigned long timers;
+	long long jitter, maxjitter; /* ns */
+	unsigned long roundtrips;
+	unsigned long flushed;  /* bytes Xlib has written */
+	unsigned int xcbseq;    /* last request sent through xcb */
+	Probe handlers[LASTEvent];
+	Probe commands[LENGTH(cmdnames)];
+	Probe *tracing;         /* whose requests are logged */
+	int tracenext;          /* trace the next command */
+} stats;
+#endif /* STATS */
+
+static Client *lastclient, *firstclient; /* ends of the focus history */
+static Client *cyclesel; /* shown by cyclehistory until the chord ends */
+static Menu menu = { .in = { -1, menuwrite }, .out = { -1, menuread } };
+static int epfd = -1;
+static sigset_t sigmask, origmask; /* signals taken through sigwatch */
+static Watch xwatch = { -1, xevents };
+static Watch sigwatch = { -1, signals };
+static Watch timerwatch = { -1, timertick };
+static Timer *wheel[256];
+static unsigned long ticks, ntimers;
+static Timer bartimer = { drawbars };
+static Timer statustimer = { updatestatus };
+static int ptrx, ptry; /* pointer position as of the last event with one */
+#ifdef XRANDR
+static int randr, rrevbase; /* whether RandR reports the monitors */
+static Timer hotplugtimer = { hotplug };
+#endif /* XRANDR */
+static Watch ipcwatch = { -1, ipcaccept };
+static IpcClient *ipcclients;
+static char ipcpath[sizeof(((struct sockaddr_un *)0)->sun_path)];
 
 void
 quit(const Arg *arg)
@@ -187,20 +596,181 @@ quit(const Arg *arg)
 	running = 0;
 }
 
-Atom
-getatomprop(Client *c, Atom prop)
+/* Saves the monitors, frames, clients and histories to _KWM_STATE on
+ * the root window and leaves run, main then execs kwm over itself. The
+ * clients stay as they are meanwhile, and scan in the new kwm takes
+ * them over from the saved state rather than asking about each one. */
+void
+restart(const Arg *arg)
 {
-	int di;
-	unsigned long dl;
-	unsigned char *p = NULL;
-	Atom da, atom = None;
+	Blob b = { 0 };
+	Monitor *m;
+	Client *c;
+	uint32_t n;
+	int i;
+
+	put32(&b, STATEMAGIC);
+	for (n = 0, m = mons; m; m = m->next, n++);
+	put32(&b, n);
+	for (m = mons; m; m = m->next) {
+		put32(&b, m->output);
+		put32(&b, m == selmon);
+		put32(&b, m->sel ? m->sel->win : None);
+		putframe(&b, m->frames);
+		for (n = 0, c = m->clients; c; c = c->next, n++);
+		put32(&b, n);
+		for (c = m->clients; c; c = c->next)
+			put32(&b, c->win);
+	}
+	for (n = 0, c = lastclient; c; c = c->hnext, n++);
+	put32(&b, n);
+	for (c = lastclient; c; c = c->hnext)
+		put32(&b, c->win);
+	put32(&b, nclientlist);
+	for (i = 0; i < nclientlist; i++)
+		put32(&b, clientlist[i]);
+	put32(&b, nclientlist);
+	for (i = 0; i < nclientlist; i++)
+		put32(&b, stacklist[i]);
+	XChangeProperty(dpy, root, stateatom, stateatom, 8, PropModeReplace,
+		b.p, b.len);
+	free(b.p);
+	restarting = 1;
+	running = 0;
+}
+
+void
+put(Blob *b, const void *p, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = MAX(2 * b->size, b->len + len + 4096);
+		b->p = erealloc(b->p, b->size);
+	}
+	memcpy(b->p + b->len, p, len);
+	b->len += len;
+}
+
+/* in host byte order, kwm reads it back on the same machine */
+void
+put32(Blob *b, uint32_t v)
+{
+	put(b, &v, sizeof(v));
+}
+
+void
+putstr(Blob *b, const char *s)
+{
+	uint32_t n = strlen(s);
 
-	if (XGetWindowProperty(dpy, c->win, prop, 0L, sizeof atom, False, XA_ATOM,
-		&da, &di, &dl, &dl, &p) == Success && p) {
-		atom = *(Atom *)p;
-		XFree(p);
+	put32(b, n);
+	put(b, s, n);
+}
+
+/* the int fields of a client kept across a restart, in saved order */
+#define CLIENTINTS(C) { &(C)->x, &(C)->y, &(C)->w, &(C)->h, \
+	&(C)->oldx, &(C)->oldy, &(C)->oldw, &(C)->oldh, &(C)->bw, &(C)->oldbw, \
+	&(C)->isfixed, &(C)->isfloating, &(C)->isurgent, &(C)->neverfocus, \
+	&(C)->oldstate, &(C)->isfullscreen }
+
+/* writes the subtree at f in preorder, leaves with their clients */
+void
+putframe(Blob *b, Frame *f)
+{
+	Client *c;
+	uint32_t n;
+	int i;
+
+	put32(b, f->split);
+	put(b, &f->ratio, sizeof(f->ratio));
+	if (f->split) {
+		putframe(b, f->child[0]);
+		putframe(b, f->child[1]);
+		return;
+	}
+	put32(b, f == f->mon->selframe);
+	put32(b, f->sel ? f->sel->win : None);
+	for (n = 0, c = f->clients; c; c = c->fnext, n++);
+	put32(b, n);
+	for (c = f->clients; c; c = c->fnext) {
+		int *v[] = CLIENTINTS(c);
+
+		put32(b, c->win);
+		for (i = 0; i < LENGTH(v); i++)
+			put32(b, *v[i]);
+		put32(b, c->protocols);
+		putstr(b, c->name);
+		putstr(b, c->cls ? c->cls->name : "");
+	}
+}
+
+/* reads len bytes, or zeroes once the blob is used up */
+void
+get(Blob *b, void *p, size_t len)
+{
+	if (b->bad || b->size - b->len < len) {
+		b->bad = 1;
+		memset(p, 0, len);
+		return;
+	}
+	memcpy(p, b->p + b->len, len);
+	b->len += len;
+}
+
+uint32_t
+get32(Blob *b)
+{
+	uint32_t v;
+
+	get(b, &v, sizeof(v));
+	return v;
+}
+
+/* reads a string into s, cut to fit size */
+void
+getstr(Blob *b, char *s, size_t size)
+{
+	uint32_t n = get32(b);
+
+	if (b->bad || b->size - b->len < n) {
+		b->bad = 1;
+		s[0] = '\0';
+		return;
+	}
+	snprintf(s, size, "%.*s", (int)n, (char *)b->p + b->len);
+	b->len += n;
+}
+
+/* reads a list of windows, keeping those of clients */
+Window *
+getwins(Blob *b, uint32_t *n)
+{
+	Window *w;
+	uint32_t i, len;
+
+	if ((len = get32(b)) > (b->size - b->len) / 4) {
+		b->bad = 1;
+		len = 0;
 	}
-	return atom;
+	w = ecalloc(MAX(len, 1), sizeof(Window));
+	for (i = *n = 0; i < len; i++)
+		if (wintoclient((w[*n] = get32(b))))
+			(*n)++;
+	return w;
+}
+
+int
+hasatom(xcb_get_property_reply_t *r, Atom atom)
+{
+	uint32_t *p;
+	int n;
+
+	if (!r || r->format != 32)
+		return 0;
+	p = xcb_get_property_value(r);
+	for (n = xcb_get_property_value_length(r) / 4; n--; )
+		if (p[n] == atom)
+			return 1;
+	return 0;
 }
 
 
@@ -216,7 +786,7 @@ focusin(XEvent *e)
 					XA_WINDOW, 32, PropModeReplace,
 					(unsigned char *) &(selmon->sel->win), 1);
 		}
-		sendevent(selmon->sel, wmatom[WMTakeFocus]);
+		sendevent(selmon->sel, WMTakeFocus);
 	}
 		
 }
@@ -225,52 +795,65 @@ focusin(XEvent *e)
 void
 configurenotify(XEvent *e)
 {
-	Monitor *m;
-	Client *c;
 	XConfigureEvent *ev = &e->xconfigure;
-	int dirty;
-	
-	/* TODO: updategeom handling sucks, needs to be simplified */
-	if (ev->window == root) {
-		dirty = (sw != ev->width || sh != ev->height);
+
+	if (ev->window != root)
+		return;
+	if (sw != ev->width || sh != ev->height) {
 		sw = ev->width;
 		sh = ev->height;
-		if (updategeom() || dirty) {
-			drw_resize(drw, sw, sh);
-			for (m = mons; m; m = m->next) {
-				for (c = m->clients; c; c = c->next)
-					/* FIXME: fix this when add frames */
-					resizeclient(c, m->mx, m->my, m->mw, m->mh);
-			}
-			focus(NULL);
-		}
+		drw_resize(drw, sw, sh);
 	}
+#ifdef XRANDR
+	if (randr)
+		return; /* the monitors follow the RandR events */
+#endif /* XRANDR */
+	if (updategeom())
+		relayout();
 }
 
 
 void
 toggleleader(const Arg *arg)
 {
+	xcb_grab_pointer_cookie_t ck;
+
 	pointergrabbed = arg->i;
-	if (arg->i) XGrabPointer(dpy, root, True, 0,
-				  GrabModeAsync, GrabModeAsync,
-				  None, cursor[CurLeaderKey]->cursor, CurrentTime);
-	else XUngrabPointer(dpy, CurrentTime);
+	if (arg->i) {
+		ck = xcb_grab_pointer(xcon, 1, root, 0, XCB_GRAB_MODE_ASYNC,
+			XCB_GRAB_MODE_ASYNC, XCB_NONE, cursor[CurLeaderKey]->cursor,
+			XCB_CURRENT_TIME);
+		SENT(ck.sequence, "GrabPointer");
+		/* the grab status is not needed, so don't wait for it */
+		xcb_discard_reply(xcon, ck.sequence);
+	} else
+		XUngrabPointer(dpy, CurrentTime);
 }
 
 void
 banish(const Arg *arg)
 {
-	XWarpPointer(dpy, None, root, 0, 0, 0, 0, selmon->mx + selmon->mw - 2, selmon->my + selmon->mh - 2);
+	ptrx = selmon->mx + selmon->mw - 2;
+	ptry = selmon->my + selmon->mh - 2;
+	XWarpPointer(dpy, None, root, 0, 0, 0, 0, ptrx, ptry);
+}
+
+/* what every child does before exec */
+void
+childsetup(void)
+{
+	if (dpy)
+		close(ConnectionNumber(dpy));
+	sigprocmask(SIG_SETMASK, &origmask, NULL);
+	signal(SIGPIPE, SIG_DFL); /* ignored by kwm only, exec keeps it */
+	setsid();
 }
 
 void
 spawn(const Arg *arg)
 {
 	if (fork() == 0) {
-		if (dpy)
-			close(ConnectionNumber(dpy));
-		setsid();
+		childsetup();
 		execvp(((char **)arg->v)[0], (char **)arg->v);
 		fprintf(stderr, "kwm: execvp %s", ((char **)arg->v)[0]);
 		perror(" failed");
@@ -307,21 +890,138 @@ xerror(Display *dpy, XErrorEvent *ee)
 	return xerrorxlib(dpy, ee); /* may call exit */
 }
 
+/* Signals arrive through a signalfd, so this runs from the main loop
+ * and not in signal context. */
 void
-sigchld(int unused)
+signals(Watch *w, unsigned int events)
 {
-	if (signal(SIGCHLD, sigchld) == SIG_ERR)
-		die("can't install SIGCHLD handler:");
-	while (0 < waitpid(-1, NULL, WNOHANG));
+	struct signalfd_siginfo si;
+
+	while (read(sigwatch.fd, &si, sizeof si) == sizeof si) {
+		switch (si.ssi_signo) {
+		case SIGCHLD:
+			while (0 < waitpid(-1, NULL, WNOHANG));
+			break;
+		case SIGTERM:
+		case SIGHUP:
+			running = 0;
+			break;
+#ifdef STATS
+		case SIGUSR1:
+			dumpstats();
+			break;
+		case SIGUSR2:
+			stats.tracenext = 1;
+			fputs("kwm: tracing the next command\n", stderr);
+			break;
+#endif /* STATS */
+		}
+	}
+}
+
+void
+watchfd(Watch *w, unsigned int events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = w };
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0)
+		die("kwm: epoll_ctl failed");
+}
+
+/* must be called before w->fd is closed, forked children may keep the
+ * file open and with it the epoll registration */
+void
+unwatchfd(Watch *w)
+{
+	if (w->fd >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+}
+
+long long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Runs t->func once after ms milliseconds, rounded up to the wheel
+ * resolution. The timerfd only ticks while timers are pending. */
+void
+armtimer(Timer *t, unsigned int ms)
+{
+	struct itimerspec its = { { 0, TICKMS * 1000000L }, { 0, TICKMS * 1000000L } };
+	Timer **slot;
+
+	disarmtimer(t);
+	if (!ntimers++) {
+		ticks = 0;
+		timerfd_settime(timerwatch.fd, 0, &its, NULL);
+	}
+	t->expires = ticks + MAX(1, (ms + TICKMS - 1) / TICKMS);
+	t->due = now() + ms * 1000000LL;
+	slot = &wheel[t->expires % LENGTH(wheel)];
+	if ((t->next = *slot))
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+void
+disarmtimer(Timer *t)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	if (!t->pprev)
+		return;
+	if ((*t->pprev = t->next))
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+	if (!--ntimers)
+		timerfd_settime(timerwatch.fd, 0, &its, NULL);
+}
+
+void
+timertick(Watch *w, unsigned int events)
+{
+	uint64_t n;
+	unsigned long i, start;
+	Timer **slot, *t;
+
+	if (read(timerwatch.fd, &n, sizeof n) != sizeof n)
+		return;
+	/* advance first, so timers armed by callbacks land after now */
+	start = ticks;
+	ticks += n;
+	/* a late wakeup covers several ticks, at most one lap of the wheel */
+	for (i = 0; i < MIN(n, LENGTH(wheel)); i++) {
+		slot = &wheel[(start + 1 + i) % LENGTH(wheel)];
+		for (t = *slot; t; ) {
+			if (t->expires > ticks) {
+				t = t->next; /* due on a later lap */
+				continue;
+			}
+			disarmtimer(t);
+#ifdef STATS
+			stats.timers++;
+			stats.jitter += now() - t->due;
+			stats.maxjitter = MAX(stats.maxjitter, now() - t->due);
+#endif /* STATS */
+			t->func();
+			t = *slot; /* the callback may have changed the slot */
+		}
+	}
 }
 
 #ifdef XINERAMA
 static int
-isuniquegeom(XineramaScreenInfo *unique, size_t n, XineramaScreenInfo *info)
+isuniquegeom(Output *unique, size_t n, XineramaScreenInfo *info)
 {
 	while (n--)
-		if (unique[n].x_org == info->x_org && unique[n].y_org == info->y_org
-		&& unique[n].width == info->width && unique[n].height == info->height)
+		if (unique[n].x == info->x_org && unique[n].y == info->y_org
+		&& unique[n].w == info->width && unique[n].h == info->height)
 			return 0;
 	return 1;
 }
@@ -346,111 +1046,279 @@ recttomon(int x, int y, int w, int h)
 void
 cleanupmon(Monitor *mon)
 {
-	Monitor *m;
+	if (mon->barwin)
+		XDestroyWindow(dpy, mon->barwin);
+	freeframes(mon->frames);
+	slab_free(monslab, mon);
+}
 
-	if (mon == mons)
-		mons = mons->next;
-	else {
-		for (m = mons; m && m->next != mon; m = m->next);
-		m->next = mon->next;
+/* Moves every client of m to the selected frame of to, floating ones
+ * into its window area. The frame is laid out here since relayout
+ * leaves subtrees whose geometry is unchanged alone. */
+void
+evacuate(Monitor *m, Monitor *to)
+{
+	Client *c;
+	int x, y;
+
+	while ((c = m->clients)) {
+		detach(c);
+		detachstack(c);
+		detachframe(c);
+		c->mon = to;
+		attach(c);
+		attachstack(c);
+		attachframe(c, to->selframe);
+		if (c->isfloating && !c->isfullscreen) {
+			x = MAX(MIN(c->x, to->wx + to->ww - WIDTH(c)), to->wx);
+			y = MAX(MIN(c->y, to->wy + to->wh - HEIGHT(c)), to->wy);
+			resize(c, x, y, c->w, c->h, 0);
+		}
 	}
-	free(mon);
+	arrange(to->selframe);
+	to->dirty = 1;
 }
 
+/* Fills out with the monitors the server reports, at least one. With
+ * RandR each active CRTC is a monitor, so clones count once. */
 int
-updategeom(void)
+getoutputs(Output **out)
 {
-	int dirty = 0;
-
-#ifdef XINERAMA
-	if (XineramaIsActive(dpy)) {
-		int i, j, n, nn;
-		Client *c;
-		Monitor *m;
-		XineramaScreenInfo *info = XineramaQueryScreens(dpy, &nn);
-		XineramaScreenInfo *unique = NULL;
-
-		for (n = 0, m = mons; m; m = m->next, n++);
-		/* only consider unique geometries as separate screens */
-		unique = ecalloc(nn, sizeof(XineramaScreenInfo));
-		for (i = 0, j = 0; i < nn; i++)
-			if (isuniquegeom(unique, j, &info[i]))
-				memcpy(&unique[j++], &info[i], sizeof(XineramaScreenInfo));
-		XFree(info);
-		nn = j;
-		if (n <= nn) { /* new monitors available */
-			for (i = 0; i < (nn - n); i++) {
-				for (m = mons; m && m->next; m = m->next);
-				if (m)
-					m->next = createmon();
-				else
-					mons = createmon();
-			}
-			for (i = 0, m = mons; i < nn && m; m = m->next, i++)
-				if (i >= n
-				|| unique[i].x_org != m->mx || unique[i].y_org != m->my
-				|| unique[i].width != m->mw || unique[i].height != m->mh)
-				{
-					dirty = 1;
-					m->num = i;
-					m->mx = m->wx = unique[i].x_org;
-					m->my = m->wy = unique[i].y_org;
-					m->mw = m->ww = unique[i].width;
-					m->mh = m->wh = unique[i].height;
-				}
-		} else { /* less monitors available nn < n */
-			for (i = nn; i < n; i++) {
-				for (m = mons; m && m->next; m = m->next);
-				while ((c = m->clients)) {
-					dirty = 1;
-					m->clients = c->next;
-					c->mon = mons;
-				}
-				if (m == selmon)
-					selmon = mons;
-				cleanupmon(m);
+	int n = 0;
+
+	*out = NULL;
+#ifdef XRANDR
+	if (randr) {
+		XRRScreenResources *res;
+		XRRCrtcInfo *ci;
+		int i;
+
+		if ((res = ROUNDTRIP(XRRGetScreenResourcesCurrent(dpy, root)))) {
+			*out = ecalloc(MAX(res->ncrtc, 1), sizeof(Output));
+			for (i = 0; i < res->ncrtc; i++) {
+				if (!(ci = ROUNDTRIP(XRRGetCrtcInfo(dpy, res, res->crtcs[i]))))
+					continue;
+				if (ci->noutput && ci->width && ci->height)
+					(*out)[n++] = (Output){ ci->outputs[0], ci->x, ci->y, ci->width, ci->height };
+				XRRFreeCrtcInfo(ci);
 			}
+			XRRFreeScreenResources(res);
 		}
-		free(unique);
 	} else
+#endif /* XRANDR */
+#ifdef XINERAMA
+	if (ROUNDTRIP(XineramaIsActive(dpy))) {
+		XineramaScreenInfo *info;
+		int i, nn;
+
+		if ((info = ROUNDTRIP(XineramaQueryScreens(dpy, &nn)))) {
+			*out = ecalloc(MAX(nn, 1), sizeof(Output));
+			/* only consider unique geometries as separate screens */
+			for (i = 0; i < nn; i++)
+				if (isuniquegeom(*out, n, &info[i]))
+					(*out)[n++] = (Output){ info[i].screen_number,
+						info[i].x_org, info[i].y_org, info[i].width, info[i].height };
+			XFree(info);
+		}
+	}
 #endif /* XINERAMA */
-	{ /* default monitor setup */
-		if (!mons)
-			mons = createmon();
-		if (mons->mw != sw || mons->mh != sh) {
+	if (!n) {
+		free(*out);
+		*out = ecalloc(1, sizeof(Output));
+		(*out)[n++] = (Output){ 0, 0, 0, sw, sh };
+	}
+	return n;
+}
+
+/* Rebuilds the monitor list in output order. A monitor follows its
+ * output, so only those whose geometry changed are marked dirty, and
+ * the clients of outputs that went away move to the first monitor. */
+int
+updategeom(void)
+{
+	Output *out;
+	Monitor *m, *old, **pm, **tail;
+	int i, n, dirty = 0;
+
+	n = getoutputs(&out);
+	old = mons;
+	mons = NULL;
+	tail = &mons;
+	for (i = 0; i < n; i++) {
+		for (pm = &old; *pm && (*pm)->output != out[i].id; pm = &(*pm)->next);
+		if ((m = *pm))
+			*pm = m->next;
+		else {
+			m = createmon();
+			m->output = out[i].id;
+		}
+		if (m->mx != out[i].x || m->my != out[i].y
+		|| m->mw != out[i].w || m->mh != out[i].h) {
 			dirty = 1;
-			mons->mw = mons->ww = sw;
-			mons->mh = mons->wh = sh;
+			placemon(m, out[i].x, out[i].y, out[i].w, out[i].h);
 		}
+		m->num = i;
+		m->next = NULL;
+		*tail = m;
+		tail = &m->next;
+	}
+	free(out);
+	while ((m = old)) {
+		dirty = 1;
+		old = m->next;
+		evacuate(m, mons);
+		if (m == selmon)
+			selmon = mons;
+		cleanupmon(m);
 	}
 	if (dirty) {
-		selmon = mons;
+		if (!selmon)
+			selmon = mons;
 		selmon = wintomon(root);
 	}
 	return dirty;
 }
 
+/* lays out the monitors marked dirty, as one batch of requests */
+void
+relayout(void)
+{
+	Monitor *m;
+	Client *c;
+
+	for (m = mons; m; m = m->next)
+		if (m->dirty) {
+			updatebar(m);
+			arrange(m->frames);
+			for (c = m->clients; c; c = c->next)
+				if (c->isfullscreen)
+					resizeclient(c, m->mx, m->my, m->mw, m->mh);
+			m->dirty = 0;
+		}
+	focus(NULL);
+}
+
+#ifdef XRANDR
+/* A hotplug arrives as a storm of RandR events, the monitors are only
+ * updated once it has settled for hotplugdelay. */
+void
+rrnotify(XEvent *e)
+{
+	XRRUpdateConfiguration(e);
+	armtimer(&hotplugtimer, hotplugdelay);
+}
+
+void
+hotplug(void)
+{
+	if (updategeom())
+		relayout();
+}
+#endif /* XRANDR */
+
+void
+trackpointer(XEvent *e)
+{
+	switch (e->type) {
+	case ButtonPress:
+		ptrx = e->xbutton.x_root;
+		ptry = e->xbutton.y_root;
+		break;
+	case MotionNotify:
+		ptrx = e->xmotion.x_root;
+		ptry = e->xmotion.y_root;
+		break;
+	case EnterNotify:
+		ptrx = e->xcrossing.x_root;
+		ptry = e->xcrossing.y_root;
+		break;
+	}
+}
+
+unsigned int
+winhash(Window w)
+{
+	unsigned long h = w;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	return (unsigned int)h;
+}
+
+void
+indexclient(Client *c)
+{
+	Client **old = clienttab;
+	unsigned int i, h, oldsz = clienttabsz;
+
+	/* keep the load factor under 1/2 so probe runs stay short */
+	if (2 * (nclienttab + 1) > clienttabsz) {
+		clienttabsz = clienttabsz ? 2 * clienttabsz : 64;
+		clienttab = ecalloc(clienttabsz, sizeof(Client *));
+		nclienttab = 0;
+		for (i = 0; i < oldsz; i++)
+			if (old[i])
+				indexclient(old[i]);
+		free(old);
+	}
+	h = winhash(c->win);
+	for (i = h & (clienttabsz - 1); clienttab[i]; i = (i + 1) & (clienttabsz - 1));
+	clienttab[i] = c;
+	nclienttab++;
+	if (unmanaged[h & (LENGTH(unmanaged) - 1)] == c->win)
+		unmanaged[h & (LENGTH(unmanaged) - 1)] = None;
+}
+
+void
+unindexclient(Client *c)
+{
+	unsigned int i, j, k, mask = clienttabsz - 1;
+
+	if (!clienttab)
+		return;
+	for (i = winhash(c->win) & mask; clienttab[i] && clienttab[i] != c; i = (i + 1) & mask);
+	if (!clienttab[i])
+		return;
+	/* backward shift deletion, so no tombstones are needed */
+	for (j = (i + 1) & mask; clienttab[j]; j = (j + 1) & mask) {
+		k = winhash(clienttab[j]->win) & mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		clienttab[i] = clienttab[j];
+		i = j;
+	}
+	clienttab[i] = NULL;
+	nclienttab--;
+}
+
 Client *
 wintoclient(Window w)
 {
 	Client *c;
-	Monitor *m;
+	unsigned int i, h = winhash(w);
 
-	for (m = mons; m; m = m->next)
-		for (c = m->clients; c; c = c->next)
+	if (unmanaged[h & (LENGTH(unmanaged) - 1)] == w)
+		return NULL;
+	if (clienttab)
+		for (i = h & (clienttabsz - 1); (c = clienttab[i]); i = (i + 1) & (clienttabsz - 1))
 			if (c->win == w)
 				return c;
+	unmanaged[h & (LENGTH(unmanaged) - 1)] = w;
 	return NULL;
 }
 			
 Monitor *
 wintomon(Window w)
 {
-	int x, y;
 	Client *c;
+	Monitor *m;
 
-	if (w == root && getrootptr(&x, &y))
-		return recttomon(x, y, 1, 1);
+	if (w == root)
+		return recttomon(ptrx, ptry, 1, 1);
+	for (m = mons; m; m = m->next)
+		if (w == m->barwin)
+			return m;
 	if ((c = wintoclient(w)))
 		return c->mon;
 	return selmon;
@@ -470,7 +1338,7 @@ getrootptr(int *x, int *y)
 	unsigned int dui;
 	Window dummy;
 
-	return XQueryPointer(dpy, root, &dummy, &dummy, x, y, &di, &di, &dui);
+	return ROUNDTRIP(XQueryPointer(dpy, root, &dummy, &dummy, x, y, &di, &di, &dui));
 }
 
  
@@ -478,7 +1346,8 @@ Monitor *
 createmon(void)
 {
 	Monitor *m;
-	m = ecalloc(1, sizeof(Monitor));
+	m = slab_alloc(monslab);
+	m->frames = m->selframe = createframe(m);
 	return m;
 }
 
@@ -489,20 +1358,42 @@ checkotherwm(void)
 	xerrorxlib = XSetErrorHandler(xerrorstart);
 	/* this causes an error if some other window manager is running */
 	XSelectInput(dpy, DefaultRootWindow(dpy), SubstructureRedirectMask);
-	XSync(dpy, False);
+	xsync();
 	XSetErrorHandler(xerror);
-	XSync(dpy, False);
+	xsync();
 }
 
 
 void setup(void)
 {
 	XSetWindowAttributes wa;
-	Atom utf8string;
+	Monitor *m;
 	int i;
 	
+	/* a window selector that went away must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	/* the main loop waits on X, signals, timers and helper pipes */
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		die("kwm: epoll_create1 failed");
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCHLD);
+	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGHUP);
+#ifdef STATS
+	sigaddset(&sigmask, SIGUSR1); /* dumps the statistics */
+	sigaddset(&sigmask, SIGUSR2); /* traces the next command */
+#endif /* STATS */
+	sigprocmask(SIG_BLOCK, &sigmask, &origmask);
+	if ((sigwatch.fd = signalfd(-1, &sigmask, SFD_NONBLOCK|SFD_CLOEXEC)) < 0)
+		die("kwm: signalfd failed");
+	if ((timerwatch.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+		die("kwm: timerfd_create failed");
+	xwatch.fd = ConnectionNumber(dpy);
+	watchfd(&xwatch, EPOLLIN);
+	watchfd(&sigwatch, EPOLLIN);
+	watchfd(&timerwatch, EPOLLIN);
 	/* clean up any zombies immediately */
-	sigchld(0);
+	while (0 < waitpid(-1, NULL, WNOHANG));
 
 	/* init screen */
 	screen = DefaultScreen(dpy);
@@ -512,9 +1403,26 @@ void setup(void)
 	drw = drw_create(dpy, screen, root, sw, sh);
 	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
 		die("no fonts could be loaded.");
+	lrpad = drw->fonts->h;
+	bh = drw->fonts->h + 2;
+	clientslab = slab_create(sizeof(Client), 64);
+	monslab = slab_create(sizeof(Monitor), 8);
+	frameslab = slab_create(sizeof(Frame), 32);
+#ifdef STATS
+	XESetBeforeFlush(dpy, XAddExtension(dpy)->extension, flushhook);
+#endif /* STATS */
+	/* the only pointer query, events keep the position from here on */
+	getrootptr(&ptrx, &ptry);
+#ifdef XRANDR
+	if ((randr = XRRQueryExtension(dpy, &rrevbase, &i)))
+		XRRSelectInput(dpy, root, RRScreenChangeNotifyMask
+			|RRCrtcChangeNotifyMask|RROutputChangeNotifyMask);
+#endif /* XRANDR */
 	updategeom();
 	/* init atoms */
+	xcon = XGetXCBConnection(dpy);
 	utf8string = XInternAtom(dpy, "UTF8_STRING", False);
+	stateatom = XInternAtom(dpy, "_KWM_STATE", False);
 	wmatom[WMProtocols] = XInternAtom(dpy, "WM_PROTOCOLS", False);
 	wmatom[WMDelete] = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
 	wmatom[WMState] = XInternAtom(dpy, "WM_STATE", False);
@@ -528,6 +1436,15 @@ void setup(void)
 	netatom[NetWMWindowType] = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
 	netatom[NetWMWindowTypeDialog] = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DIALOG", False);
 	netatom[NetClientList] = XInternAtom(dpy, "_NET_CLIENT_LIST", False);
+	netatom[NetClientListStacking] = XInternAtom(dpy, "_NET_CLIENT_LIST_STACKING", False);
+	propatom[PropNetWMName] = netatom[NetWMName];
+	propatom[PropWMName] = XA_WM_NAME;
+	propatom[PropTransient] = XA_WM_TRANSIENT_FOR;
+	propatom[PropNetWMState] = netatom[NetWMState];
+	propatom[PropWindowType] = netatom[NetWMWindowType];
+	propatom[PropWMHints] = XA_WM_HINTS;
+	propatom[PropWMProtocols] = wmatom[WMProtocols];
+	propatom[PropWMClass] = XA_WM_CLASS;
 	/* init cursors */
 	cursor[CurNormal] = drw_cur_create(drw, XC_left_ptr);
 	cursor[CurResize] = drw_cur_create(drw, XC_sizing);
@@ -538,7 +1455,10 @@ void setup(void)
 	scheme = ecalloc(LENGTH(colors), sizeof(Clr *));
 	for (i = 0; i < LENGTH(colors); i++)
 		scheme[i] = drw_scm_create(drw, colors[i], 3);
-	
+	for (m = mons; m; m = m->next)
+		updatebar(m);
+	updatestatus();
+
 	/* supporting window for NetWMCheck */
 	wmcheckwin = XCreateSimpleWindow(dpy, root, 0, 0, 1, 1, 0, 0, 0);
 	XChangeProperty(dpy, wmcheckwin, netatom[NetWMCheck], XA_WINDOW, 32,
@@ -551,6 +1471,7 @@ void setup(void)
 	XChangeProperty(dpy, root, netatom[NetSupported], XA_ATOM, 32,
 		PropModeReplace, (unsigned char *) netatom, NetLast);
 	XDeleteProperty(dpy, root, netatom[NetClientList]);
+	XDeleteProperty(dpy, root, netatom[NetClientListStacking]);
 	/* select events */
 	wa.cursor = cursor[CurNormal]->cursor;
 	wa.event_mask = SubstructureRedirectMask|SubstructureNotifyMask
@@ -559,62 +1480,481 @@ void setup(void)
 	XChangeWindowAttributes(dpy, root, CWEventMask|CWCursor, &wa);
 	XSelectInput(dpy, root, wa.event_mask);
 	grabkeys();
+	setupipc();
 }
 
+/* Rebuilds the keymaps from the current keyboard mapping and grabs the
+ * root level. Deeper levels are served by a keyboard grab in keypress. */
 void
 grabkeys(void)
 {
-
-	unsigned int i;
+	unsigned int i, j;
 	unsigned int modifiers[] = { 0 }; /* For simplicity don't press other modifiers*/
-	KeyCode code;
+	int mincode, maxcode, per;
+	KeySym *syms;
+	XModifierKeymap *modmap;
+	Binding *b;
+
+	freekeymaps();
+	XDisplayKeycodes(dpy, &mincode, &maxcode);
+	syms = ROUNDTRIP(XGetKeyboardMapping(dpy, mincode, maxcode - mincode + 1, &per));
+	addkeymap(&keys, syms, mincode, maxcode, per);
+	XFree(syms);
+	currmap = &keymaps[0];
+
+	memset(modcodes, 0, sizeof modcodes);
+	modmap = ROUNDTRIP(XGetModifierMapping(dpy));
+	for (i = 0; i < 8 * modmap->max_keypermod; i++)
+		if (modmap->modifiermap[i])
+			modcodes[modmap->modifiermap[i] / 8] |= 1 << (modmap->modifiermap[i] % 8);
+	XFreeModifiermap(modmap);
 
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
-	Keys *node = currkey;
-	while (node) {
-		if ((code = XKeysymToKeycode(dpy, node->key.keysym)))
-			for (i = 0; i < LENGTH(modifiers); i++)
-				XGrabKey(dpy, code, node->key.mod | modifiers[i], root,
+	for (i = 0; i < LENGTH(currmap->code); i++)
+		for (b = currmap->code[i]; b; b = b->next)
+			for (j = 0; j < LENGTH(modifiers); j++)
+				XGrabKey(dpy, i, b->mod | modifiers[j], root,
 					 True, GrabModeAsync, GrabModeAsync);
-		node = node->siblings;
-	}
 }
 
+/* Adds the keymap for the sibling list starting at head, and those of
+ * its children, returning its index. Keysyms found on the shifted level
+ * of a key are bound with ShiftMask. */
+int
+addkeymap(Keys *head, KeySym *syms, int mincode, int maxcode, int per)
+{
+	Keys *k;
+	Binding *b, **tail;
+	int i, n, m, child, code, lvl;
+	unsigned int mod;
+
+	for (m = 0; m < nkeymaps; m++)
+		if (keymaps[m].head == head)
+			return m;
+	m = nkeymaps++;
+	keymaps = erealloc(keymaps, nkeymaps * sizeof(Keymap));
+	memset(&keymaps[m], 0, sizeof(Keymap));
+	keymaps[m].head = head;
+	for (n = 0, k = head; k; k = k->siblings, n++);
+	keymaps[m].bindings = ecalloc(n, sizeof(Binding));
+
+	for (i = 0, k = head; k; k = k->siblings, i++) {
+		if (!k->key.func && !k->child)
+			continue;
+		code = mod = 0;
+		for (lvl = 0; !code && lvl < MIN(per, 2); lvl++)
+			for (n = mincode; !code && n <= maxcode; n++)
+				if (syms[(n - mincode) * per + lvl] == k->key.keysym) {
+					code = n;
+					mod = lvl ? ShiftMask : 0;
+				}
+		if (!code)
+			continue;
+		/* may move keymaps, so index it again afterwards */
+		child = k->child ? addkeymap(k->child, syms, mincode, maxcode, per) : -1;
+		b = &keymaps[m].bindings[i];
+		b->mod = k->key.mod | mod;
+		b->node = k;
+		b->child = child;
+		/* append, so the first sibling wins on duplicates */
+		for (tail = &keymaps[m].code[code]; *tail; tail = &(*tail)->next);
+		*tail = b;
+	}
+	return m;
+}
 
 void
-run(void)
+freekeymaps(void)
 {
-	XEvent ev;
-	/* main event loop */
-	XSync(dpy, False);
-	XNextEvent(dpy, &ev);
-	while (running && !XNextEvent(dpy, &ev))
-		if (handler[ev.type])
-			handler[ev.type](&ev);			
+	int i;
+
+	for (i = 0; i < nkeymaps; i++)
+		free(keymaps[i].bindings);
+	free(keymaps);
+	keymaps = currmap = NULL;
+	nkeymaps = 0;
 }
 
 void
-keypress(XEvent *e)
+mappingnotify(XEvent *e)
 {
-	KeySym keysym;
-	XKeyEvent *ev;
-	
-	ev = &e->xkey;
-	keysym = XKeycodeToKeysym(dpy, (KeyCode)ev->keycode, 0);
-
-	Keys *node = currkey;
-	while (node) {
-		if (keysym == node->key.keysym && CLEANMASK(node->key.mod) == CLEANMASK(ev->state) && node->key.func) {
-			node->key.func(&(node->key.arg));
-			currkey = node->child;
+	XMappingEvent *ev = &e->xmapping;
+
+	XRefreshKeyboardMapping(ev);
+	if (ev->request == MappingKeyboard || ev->request == MappingModifier) {
+		if (currmap != &keymaps[0]) {
+			toggleleader(&(Arg){.i = 0});
+			XUngrabKeyboard(dpy, CurrentTime);
 		}
-		node = node->siblings;
-	}
-	if (currkey == NULL) {
-		toggleleader(&(Arg){.i = 0});
-		currkey = &keys;
+		grabkeys();
+	}
+}
+
+
+void
+run(void)
+{
+	struct epoll_event ev[16];
+	int i, n;
+
+	/* main event loop, handlers only queue requests; the output
+	 * buffer is flushed once when the event queue has drained */
+	xsync();
+	while (running) {
+		/* events Xlib read along with a reply never wake epoll */
+		if (XEventsQueued(dpy, QueuedAlready)) {
+			xevents(&xwatch, EPOLLIN);
+			continue;
+		}
+		updateclientlist();
+		XFlush(dpy);
+		if ((n = epoll_wait(epfd, ev, LENGTH(ev), -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("kwm: epoll_wait failed");
+		}
+		for (i = 0; i < n && running; i++)
+			((Watch *)ev[i].data.ptr)->func(ev[i].data.ptr, ev[i].events);
+	}
+}
+
+void
+xevents(Watch *w, unsigned int events)
+{
+	static XEvent batch[256];
+	int n;
+
+	for (n = 0; n < LENGTH(batch) && XEventsQueued(dpy, QueuedAfterReading); n++)
+		XNextEvent(dpy, &batch[n]);
+	coalesce(batch, n);
+	dispatch(batch, n);
+}
+
+/* whether the later event a makes the earlier event b redundant */
+int
+supersedes(XEvent *a, XEvent *b)
+{
+	if (a->type != b->type)
+		return 0;
+	switch (a->type) {
+	case ConfigureRequest:
+		return a->xconfigurerequest.window == b->xconfigurerequest.window;
+	case ConfigureNotify:
+		return a->xconfigure.window == b->xconfigure.window;
+	case MotionNotify:
+		return a->xmotion.window == b->xmotion.window;
+	case PropertyNotify:
+		return a->xproperty.window == b->xproperty.window
+			&& a->xproperty.atom == b->xproperty.atom;
+	case MappingNotify:
+		return a->xmapping.request == b->xmapping.request;
+	}
+	return 0;
+}
+
+/* Drops events of a batch that a later event of the same batch makes
+ * redundant by setting their type to 0. Stacked ConfigureRequests are
+ * merged into the last one, and auto-repeated KeyPresses (a KeyRelease
+ * and KeyPress pair with the same time) collapse into the first press. */
+void
+coalesce(XEvent *ev, int n)
+{
+	XConfigureRequestEvent *a, *b;
+	int i, j, lastkey = -1;
+
+	for (i = 0; i < n; i++) {
+		if (ev[i].type == KeyPress) {
+			if (lastkey >= 0 && i > 0 && ev[i - 1].type == KeyRelease
+			&& ev[i - 1].xkey.keycode == ev[i].xkey.keycode
+			&& ev[i - 1].xkey.time == ev[i].xkey.time
+			&& ev[lastkey].xkey.keycode == ev[i].xkey.keycode
+			&& ev[lastkey].xkey.state == ev[i].xkey.state) {
+				ev[i - 1].type = ev[i].type = 0;
+				STAT(coalesced[KeyPress]);
+			} else
+				lastkey = i;
+			continue;
+		}
+		for (j = i + 1; j < n; j++)
+			if (supersedes(&ev[j], &ev[i]))
+				break;
+		if (j == n)
+			continue;
+		if (ev[i].type == ConfigureRequest) {
+			a = &ev[j].xconfigurerequest;
+			b = &ev[i].xconfigurerequest;
+			if (b->value_mask & ~a->value_mask & CWX) a->x = b->x;
+			if (b->value_mask & ~a->value_mask & CWY) a->y = b->y;
+			if (b->value_mask & ~a->value_mask & CWWidth) a->width = b->width;
+			if (b->value_mask & ~a->value_mask & CWHeight) a->height = b->height;
+			if (b->value_mask & ~a->value_mask & CWBorderWidth) a->border_width = b->border_width;
+			if (b->value_mask & ~a->value_mask & CWSibling) a->above = b->above;
+			if (b->value_mask & ~a->value_mask & CWStackMode) a->detail = b->detail;
+			a->value_mask |= b->value_mask;
+		}
+		STAT(coalesced[ev[i].type]);
+		ev[i].type = 0;
+	}
+}
+
+/* Input goes first so a key chord never waits behind client traffic. */
+void
+dispatch(XEvent *ev, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (ev[i].type == KeyPress) {
+			STAT(events);
+			PROBE(&stats.handlers[KeyPress], handler[KeyPress](&ev[i]));
+		}
+	for (i = 0; i < n; i++) {
+		if (ev[i].type && ev[i].type != KeyPress && ev[i].type < LASTEvent) {
+			STAT(events);
+			if (handler[ev[i].type])
+				PROBE(&stats.handlers[ev[i].type], handler[ev[i].type](&ev[i]));
+		}
+#ifdef XRANDR
+		else if (randr && (ev[i].type == rrevbase + RRScreenChangeNotify
+		|| ev[i].type == rrevbase + RRNotify)) {
+			STAT(events);
+			rrnotify(&ev[i]);
+		}
+#endif /* XRANDR */
+	}
+}
+
+/* Only for where a round trip is really needed, i.e. to collect
+ * errors while xerrordummy is installed. */
+void
+xsync(void)
+{
+	STAT(syncs);
+	ROUNDTRIP(XSync(dpy, False));
+}
+
+void
+dumpstats(void)
+{
+#ifdef STATS
+	int i;
+
+	fprintf(stderr, "kwm: %lu events, %lu syncs (%.3f per event)\n",
+		stats.events, stats.syncs,
+		stats.events ? (double)stats.syncs / stats.events : 0.0);
+	for (i = 0; i < LASTEvent; i++)
+		if (stats.coalesced[i])
+			fprintf(stderr, "kwm: %lu %s coalesced\n", stats.coalesced[i], evname[i]);
+	if (stats.timers)
+		fprintf(stderr, "kwm: %lu timers, jitter %lld us mean, %lld us max\n",
+			stats.timers, stats.jitter / (long long)stats.timers / 1000,
+			stats.maxjitter / 1000);
+	fprintf(stderr, "kwm: client slab: %zu in use, %zu peak, %zu pages, %lu allocs, %lu frees\n",
+		clientslab->inuse, clientslab->peak, clientslab->npages,
+		clientslab->allocs, clientslab->frees);
+	fprintf(stderr, "kwm: %lu requests, %lu round trips, %lu bytes\n",
+		xrequests(), stats.roundtrips, xbytes());
+	for (i = 0; i < LASTEvent; i++)
+		probedump(&stats.handlers[i], evname[i]);
+	for (i = 0; i < LENGTH(cmdnames); i++)
+		probedump(&stats.commands[i], cmdnames[i].name);
+#endif /* STATS */
+}
+
+#ifdef STATS
+void
+histadd(Hist *h, long long ns)
+{
+	unsigned long long v = MAX(ns, 0);
+	int b, msb;
+
+	if (v < 1 << HISTSUB)
+		b = v;
+	else {
+		msb = 63 - __builtin_clzll(v);
+		b = ((msb - HISTSUB + 1) << HISTSUB) + ((v >> (msb - HISTSUB)) & ((1 << HISTSUB) - 1));
+	}
+	h->n[MIN(b, LENGTH(h->n) - 1)]++;
+	h->count++;
+	h->max = MAX(h->max, ns);
+}
+
+/* upper bound of the bucket holding the q quantile, at most the max */
+long long
+histquantile(Hist *h, double q)
+{
+	unsigned long sum = 0, want = q * h->count + 0.5;
+	long long hi;
+	int b, p;
+
+	for (b = 0; b < LENGTH(h->n) - 1 && (sum += h->n[b]) < MAX(want, 1); b++);
+	if (b < 1 << HISTSUB)
+		hi = b + 1;
+	else {
+		p = b >> HISTSUB;
+		hi = (long long)((1 << HISTSUB | (b & ((1 << HISTSUB) - 1))) + 1) << (p - 1);
+	}
+	return MIN(hi, h->max);
+}
+
+void
+probedump(Probe *p, const char *name)
+{
+	unsigned long n = p->lat.count;
+
+	if (!n)
+		return;
+	fprintf(stderr, "kwm: %-16s %8lu  p50 %8.1f us  p99 %8.1f us  max %8.1f us"
+		"  %6.1f req  %5.2f rtt  %7.1f bytes\n",
+		name, n, histquantile(&p->lat, 0.50) / 1e3,
+		histquantile(&p->lat, 0.99) / 1e3, p->lat.max / 1e3,
+		(double)p->requests / n, (double)p->roundtrips / n, (double)p->bytes / n);
+}
+
+/* also starts the trace when one was asked for */
+Probe *
+cmdprobe(void (*func)(const Arg *))
+{
+	int i;
+
+	for (i = 0; i < LENGTH(cmdnames) - 1 && cmdnames[i].func != func; i++);
+	if (stats.tracenext) {
+		XFlush(dpy); /* earlier requests are not part of it */
+		stats.tracenext = 0;
+		stats.tracing = &stats.commands[i];
+		fprintf(stderr, "kwm: trace %s\n", cmdnames[i].name);
+	}
+	return &stats.commands[i];
+}
+
+/* sequence number of the last request, Xlib only catches up with the
+ * requests sent through xcb on its own next request */
+unsigned long
+xrequests(void)
+{
+	return MAX(NextRequest(dpy) - 1, stats.xcbseq);
+}
+
+/* bytes Xlib has written or holds in its output buffer */
+unsigned long
+xbytes(void)
+{
+	return stats.flushed + (dpy->bufptr - dpy->buffer);
+}
+
+void
+snapshot(Snap *s)
+{
+	s->t = now();
+	s->requests = xrequests();
+	s->roundtrips = stats.roundtrips;
+	s->bytes = xbytes();
+}
+
+void
+account(Probe *p, Snap *s)
+{
+	histadd(&p->lat, now() - s->t);
+	if (stats.tracing == p)
+		XFlush(dpy); /* for flushhook to log what is left */
+	p->requests += xrequests() - s->requests;
+	p->roundtrips += stats.roundtrips - s->roundtrips;
+	p->bytes += xbytes() - s->bytes;
+	if (stats.tracing == p) {
+		fprintf(stderr, "kwm: trace done, %lu requests, %lu round trips, %lu bytes\n",
+			xrequests() - s->requests, stats.roundtrips - s->roundtrips,
+			xbytes() - s->bytes);
+		stats.tracing = NULL;
+	}
+}
+
+/* called by ROUNDTRIP before a call that waits for the server */
+void
+roundtrip(const char *call)
+{
+	stats.roundtrips++;
+	if (stats.tracing)
+		fprintf(stderr, "kwm: trace   round trip in %.*s\n", (int)strcspn(call, "("), call);
+}
+
+/* called by SENT after a request sent through xcb */
+void
+sent(unsigned int seq, const char *name)
+{
+	stats.xcbseq = seq;
+	if (stats.tracing)
+		fprintf(stderr, "kwm: trace   %s (xcb)\n", name);
+}
+
+/* Xlib hands every buffer it writes to this hook, in trace mode the
+ * requests in it are logged by name */
+void
+flushhook(Display *d, XExtCodes *codes, const char *data, long len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	char num[16], name[64];
+	unsigned long n;
+	uint16_t len16;
+	uint32_t len32;
+	long i;
+
+	stats.flushed += len;
+	if (!stats.tracing)
+		return;
+	for (i = 0; i + 4 <= len; i += n) {
+		snprintf(num, sizeof(num), "%d", p[i]);
+		if (p[i] < 128)
+			XGetErrorDatabaseText(d, "XRequest", num, num, name, sizeof(name));
+		else
+			snprintf(name, sizeof(name), "extension %d.%d", p[i], p[i + 1]);
+		fprintf(stderr, "kwm: trace   %s\n", name);
+		memcpy(&len16, p + i + 2, 2);
+		if (!(n = 4UL * len16) && i + 8 <= len) {
+			memcpy(&len32, p + i + 4, 4); /* BIG-REQUESTS */
+			n = 4UL * len32;
+		}
+		if (!n)
+			break;
+	}
+}
+#endif /* STATS */
+
+void
+keypress(XEvent *e)
+{
+	XKeyEvent *ev = &e->xkey;
+	xcb_grab_keyboard_cookie_t ck;
+	Binding *b;
+
+	ptrx = ev->x_root;
+	ptry = ev->y_root;
+	if (ev->keycode >= LENGTH(currmap->code))
+		return;
+	/* modifiers pressed on their own don't end a chord */
+	if (modcodes[ev->keycode / 8] & (1 << (ev->keycode % 8)))
+		return;
+	for (b = currmap->code[ev->keycode]; b; b = b->next)
+		if (CLEANMASK(b->mod) == CLEANMASK(ev->state))
+			break;
+	if (b && b->node->key.func)
+		PROBE(cmdprobe(b->node->key.func), b->node->key.func(&(b->node->key.arg)));
+	if (b && b->child >= 0) {
+		/* hold the whole keyboard while a prefix is active instead of
+		 * grabbing every key of the next level */
+		if (currmap == &keymaps[0]) {
+			ck = xcb_grab_keyboard(xcon, 1, root, XCB_CURRENT_TIME,
+				XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+			SENT(ck.sequence, "GrabKeyboard");
+			xcb_discard_reply(xcon, ck.sequence);
+		}
+		currmap = &keymaps[b->child];
+	} else if (currmap != &keymaps[0]) {
+		/* last key of the chord, or one bound to nothing */
+		toggleleader(&(Arg){.i = 0});
+		XUngrabKeyboard(dpy, CurrentTime);
+		currmap = &keymaps[0];
+		endcycle();
 	}
-	grabkeys();
 }
 
 void
@@ -629,18 +1969,45 @@ detach(Client *c)
 void
 detachstack(Client *c)
 {
-	Client **tc, *t;
-
-	for (tc = &lastclient; *tc && *tc != c; tc = &(*tc)->snext);
-	*tc = c->snext;
+	if (c->hprev)
+		c->hprev->hnext = c->hnext;
+	else if (lastclient == c)
+		lastclient = c->hnext;
+	if (c->hnext)
+		c->hnext->hprev = c->hprev;
+	else if (firstclient == c)
+		firstclient = c->hprev;
+	if (c->sprev)
+		c->sprev->snext = c->snext;
+	else if (c->mon->stack == c)
+		c->mon->stack = c->snext;
+	if (c->snext)
+		c->snext->sprev = c->sprev;
+	c->hprev = c->hnext = c->sprev = c->snext = NULL;
 }
 
-
 void
 attachstack(Client *c)
 {
-	c->snext = lastclient;
+	c->hnext = lastclient;
+	if (lastclient)
+		lastclient->hprev = c;
+	else
+		firstclient = c;
 	lastclient = c;
+	c->snext = c->mon->stack;
+	if (c->snext)
+		c->snext->sprev = c;
+	c->mon->stack = c;
+}
+
+/* moves c to the front of every history it is part of */
+void
+promote(Client *c)
+{
+	detachstack(c);
+	attachstack(c);
+	promoteclass(c);
 }
 
 void
@@ -650,6 +2017,15 @@ unmanage(Client *c, int destroyed)
 
 	detach(c);
 	detachstack(c);
+	detachframe(c);
+	detachclass(c);
+	unindexclient(c);
+	if (c == cyclesel)
+		cyclesel = NULL;
+	if (c->mon->sel == c) {
+		c->mon->sel = c->mon->selframe->sel;
+		markbar(c->mon, SegTitle);
+	}
 	if (!destroyed) {
 		wc.border_width = c->oldbw;
 		XGrabServer(dpy); /* avoid race conditions */
@@ -657,50 +2033,743 @@ unmanage(Client *c, int destroyed)
 		XConfigureWindow(dpy, c->win, CWBorderWidth, &wc); /* restore border */
 		XUngrabButton(dpy, AnyButton, AnyModifier, c->win);
 		setclientstate(c, WithdrawnState);
-		XSync(dpy, False);
+		xsync();
 		XSetErrorHandler(xerror);
 		XUngrabServer(dpy);
 	}
+	unlistclient(c);
+	ipcnotify(IpcEvUnmap, c->win);
 	focus(NULL);
-	free(c);
-	updateclientlist();
+	slab_free(clientslab, c);
+}
+
+/* Publishes both client lists with one request each, at most once per
+ * event batch. */
+void
+updateclientlist(void)
+{
+	if (!clientlistdirty)
+		return;
+	XChangeProperty(dpy, root, netatom[NetClientList], XA_WINDOW, 32,
+		PropModeReplace, (unsigned char *)clientlist, nclientlist);
+	XChangeProperty(dpy, root, netatom[NetClientListStacking], XA_WINDOW, 32,
+		PropModeReplace, (unsigned char *)stacklist, nclientlist);
+	clientlistdirty = 0;
+}
+
+void
+listclient(Client *c)
+{
+	if (nclientlist == clientlistsz) {
+		clientlistsz = clientlistsz ? 2 * clientlistsz : 64;
+		clientlist = erealloc(clientlist, clientlistsz * sizeof(Window));
+		stacklist = erealloc(stacklist, clientlistsz * sizeof(Window));
+	}
+	clientlist[nclientlist] = stacklist[nclientlist] = c->win;
+	nclientlist++;
+	clientlistdirty = 1;
+}
+
+void
+unlistclient(Client *c)
+{
+	int i, j;
+
+	for (i = j = 0; i < nclientlist; i++)
+		if (clientlist[i] != c->win)
+			clientlist[j++] = clientlist[i];
+	for (i = j = 0; i < nclientlist; i++)
+		if (stacklist[i] != c->win)
+			stacklist[j++] = stacklist[i];
+	nclientlist = j;
+	clientlistdirty = 1;
+}
+
+void
+raiseclient(Client *c)
+{
+	int i;
+
+	XRaiseWindow(dpy, c->win);
+	for (i = 0; i < nclientlist && stacklist[i] != c->win; i++);
+	if (i >= nclientlist - 1)
+		return; /* already on top, or not listed yet */
+	memmove(&stacklist[i], &stacklist[i + 1], (nclientlist - i - 1) * sizeof(Window));
+	stacklist[nclientlist - 1] = c->win;
+	clientlistdirty = 1;
+}
+
+
+/* focuses the most recent client of the class, if any */
+int
+raiseclass(const char *name)
+{
+	Class *cls;
+
+	if (!(cls = getclass(name, 0)) || !cls->clients)
+		return 0;
+	focus(cls->clients);
+	return 1;
+}
+
+void
+runorraise(const Arg *arg)
+{
+	if (!raiseclass(((char **)arg->v)[4]))
+		spawn(arg);
+}
+
+unsigned int
+classhash(const char *name)
+{
+	unsigned int h = 2166136261u; /* FNV-1a */
+
+	for (; *name; name++)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h & (LENGTH(classtab) - 1);
+}
+
+/* Lists the clients, most recent first, in dmenu and focuses the one
+ * picked. The event loop keeps running while the menu is open. */
+void
+changeclient(const Arg *arg)
+{
+	int in[2], out[2];
+	size_t i, n;
+	Client *c;
+	Refresh *r;
+
+	if (menu.pid || !lastclient)
+		return;
+	if (pipe(in) < 0)
+		return;
+	if (pipe(out) < 0) {
+		close(in[0]);
+		close(in[1]);
+		return;
+	}
+	if ((menu.pid = fork()) == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		childsetup();
+		execvp(((char **)arg->v)[0], (char **)arg->v);
+		fprintf(stderr, "kwm: execvp %s", ((char **)arg->v)[0]);
+		perror(" failed");
+		exit(EXIT_SUCCESS);
+	}
+	close(in[0]);
+	close(out[1]);
+	if (menu.pid < 0) {
+		menu.pid = 0;
+		close(in[1]);
+		close(out[0]);
+		return;
+	}
+	menu.in.fd = in[1];
+	menu.out.fd = out[0];
+	fcntl(menu.in.fd, F_SETFL, O_NONBLOCK);
+	fcntl(menu.out.fd, F_SETFL, O_NONBLOCK);
+	fcntl(menu.in.fd, F_SETFD, FD_CLOEXEC);
+	fcntl(menu.out.fd, F_SETFD, FD_CLOEXEC);
+	watchfd(&menu.in, EPOLLOUT);
+	watchfd(&menu.out, EPOLLIN);
+
+	for (menu.nwins = 0, c = lastclient; c; c = c->hnext, menu.nwins++);
+	/* titles that changed are reread in one round trip */
+	r = ecalloc(menu.nwins, sizeof(Refresh));
+	for (n = 0, c = lastclient; c; c = c->hnext)
+		if (c->stale & StaleTitle)
+			refreshrequest(&r[n++], c, StaleTitle);
+	if (n)
+		ROUNDTRIP(refreshreply(&r[0]));
+	for (i = 1; i < n; i++)
+		refreshreply(&r[i]);
+	free(r);
+	menu.wins = ecalloc(menu.nwins, sizeof(Window));
+	menu.list = ecalloc(menu.nwins, sizeof c->name + 16);
+	menu.len = menu.off = menu.nsel = 0;
+	for (n = 0, c = lastclient; c; c = c->hnext, n++) {
+		menu.wins[n] = c->win;
+		menu.len += sprintf(menu.list + menu.len, "%zu %s\n", n, c->name);
+	}
+	menuwrite(&menu.in, EPOLLOUT);
+}
+
+void
+menuwrite(Watch *w, unsigned int events)
+{
+	ssize_t n;
+
+	if (menu.in.fd < 0)
+		return;
+	while (menu.off < menu.len) {
+		if ((n = write(menu.in.fd, menu.list + menu.off, menu.len - menu.off)) < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return; /* epoll tells when there is room again */
+			break;
+		}
+		menu.off += n;
+	}
+	/* all written, or dmenu went away: EOF ends its input */
+	unwatchfd(&menu.in);
+	close(menu.in.fd);
+	menu.in.fd = -1;
+	free(menu.list);
+	menu.list = NULL;
+}
+
+void
+menuread(Watch *w, unsigned int events)
+{
+	ssize_t n;
+	char *end;
+	long i;
+	Client *c;
+
+	while ((n = read(menu.out.fd, menu.sel + menu.nsel, sizeof menu.sel - 1 - menu.nsel)) > 0)
+		if ((menu.nsel += n) == sizeof menu.sel - 1)
+			break;
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	/* dmenu exited: the selection starts with the line number */
+	menu.sel[menu.nsel] = '\0';
+	i = strtol(menu.sel, &end, 10);
+	if (end != menu.sel && i >= 0 && i < menu.nwins && (c = wintoclient(menu.wins[i])))
+		focus(c);
+	closemenu();
+}
+
+void
+closemenu(void)
+{
+	if (menu.in.fd >= 0) {
+		unwatchfd(&menu.in);
+		close(menu.in.fd);
+	}
+	if (menu.out.fd >= 0) {
+		unwatchfd(&menu.out);
+		close(menu.out.fd);
+	}
+	free(menu.list);
+	free(menu.wins);
+	menu.list = NULL;
+	menu.wins = NULL;
+	menu.pid = 0;
+	menu.in.fd = menu.out.fd = -1;
+}
+
+/* Listens on the IPC socket, see ipc.h for the protocol. Failing to
+ * set it up only costs the IPC, not the session. */
+void
+setupipc(void)
+{
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	struct stat st;
+	const char *dir, *path;
+	mode_t mask;
+	int n;
+
+	if ((path = getenv("KWM_SOCKET")))
+		n = snprintf(ipcpath, sizeof(ipcpath), "%s", path);
+	else if ((dir = getenv("XDG_RUNTIME_DIR")))
+		n = snprintf(ipcpath, sizeof(ipcpath), "%s/kwm%s.sock", dir, DisplayString(dpy));
+	else {
+		/* /tmp is shared, the socket goes in a directory only we can write */
+		snprintf(ipcpath, sizeof(ipcpath), "/tmp/kwm-%u", (unsigned int)getuid());
+		if ((mkdir(ipcpath, 0700) < 0 && errno != EEXIST) || lstat(ipcpath, &st) < 0
+		|| !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+			fprintf(stderr, "kwm: IPC directory %s is not ours alone\n", ipcpath);
+			return;
+		}
+		n = snprintf(ipcpath, sizeof(ipcpath), "/tmp/kwm-%u/kwm%s.sock",
+			(unsigned int)getuid(), DisplayString(dpy));
+	}
+	if (n < 0 || n >= sizeof(ipcpath)) {
+		fputs("kwm: IPC socket path too long\n", stderr);
+		return;
+	}
+	/* checkotherwm passed, so a socket of ours left here is stale */
+	if (lstat(ipcpath, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+			fprintf(stderr, "kwm: %s is in the way of the IPC socket\n", ipcpath);
+			return;
+		}
+		unlink(ipcpath);
+	}
+	memcpy(sa.sun_path, ipcpath, n + 1);
+	if ((ipcwatch.fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0) {
+		perror("kwm: IPC socket failed");
+		return;
+	}
+	mask = umask(077);
+	n = bind(ipcwatch.fd, (struct sockaddr *)&sa, sizeof(sa));
+	umask(mask);
+	if (n < 0 || listen(ipcwatch.fd, 8) < 0) {
+		perror("kwm: IPC bind failed");
+		close(ipcwatch.fd);
+		ipcwatch.fd = -1;
+		return;
+	}
+	setenv("KWM_SOCKET", ipcpath, 1);
+	watchfd(&ipcwatch, EPOLLIN);
+}
+
+void
+ipcaccept(Watch *w, unsigned int events)
+{
+	IpcClient *ic;
+	int fd;
+
+	while ((fd = accept(w->fd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		ic = ecalloc(1, sizeof(IpcClient));
+		ic->watch.fd = fd;
+		ic->watch.func = ipcread;
+		ic->next = ipcclients;
+		ipcclients = ic;
+		watchfd(&ic->watch, EPOLLIN|EPOLLRDHUP);
+	}
+}
+
+/* Runs the messages queued on a connection, answering each one. The
+ * number read per wakeup is bounded so X events are not starved. */
+void
+ipcread(Watch *w, unsigned int events)
+{
+	static unsigned char buf[IPCMSGMAX];
+	IpcClient *ic = (IpcClient *)w;
+	IpcMsg r;
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		/* MSG_TRUNC returns the real length of an oversized message */
+		if ((n = recv(w->fd, buf, sizeof(buf), MSG_TRUNC)) < 0 && errno == EAGAIN)
+			return;
+		/* an empty message reads like a hangup, epoll tells them apart */
+		if (n < 0 || (n == 0 && (events & (EPOLLHUP|EPOLLRDHUP)))) {
+			ipcclose(ic);
+			return;
+		}
+		if (n > sizeof(buf))
+			r = (IpcMsg){ .type = IpcReply, .status = IpcBadCommand };
+		else
+			ipcexec(ic, buf, n, &r);
+		send(w->fd, &r, sizeof(r), MSG_DONTWAIT|MSG_NOSIGNAL);
+	}
+}
+
+void
+ipcexec(IpcClient *ic, unsigned char *p, size_t len, IpcMsg *r)
+{
+	unsigned char *end = p + len;
+	char *argv[64];
+	const Arg arg = { .v = argv };
+	uint32_t win;
+	uint16_t n;
+	Client *c;
+	int op;
+
+	r->type = IpcReply;
+	r->status = IpcOk;
+	r->pad = 0;
+	for (r->arg = 0; p < end; r->arg++) {
+		switch ((op = *p++)) {
+		case IpcFocus:
+			if (end - p < sizeof(win))
+				goto bad;
+			memcpy(&win, p, sizeof(win));
+			p += sizeof(win);
+			if ((c = wintoclient(win)))
+				focus(c);
+			break;
+		case IpcNextClient:
+			nextclient(&arg);
+			break;
+		case IpcPrevClient:
+			prevclient(&arg);
+			break;
+		case IpcKillClient:
+			killclient(&arg);
+			break;
+		case IpcNextFrame:
+			nextframe(&arg);
+			break;
+		case IpcSpawn:
+		case IpcRunOrRaise:
+			if (end - p < sizeof(n))
+				goto bad;
+			memcpy(&n, p, sizeof(n));
+			p += sizeof(n);
+			if (end - p < n || ipcargv(p, n, argv, LENGTH(argv)) < (op == IpcSpawn ? 1 : 2))
+				goto bad;
+			p += n;
+			if (op == IpcSpawn)
+				spawn(&arg);
+			else if (!raiseclass(argv[0]))
+				spawn(&(const Arg){ .v = argv + 1 });
+			break;
+		case IpcSubscribe:
+			if (end - p < 1)
+				goto bad;
+			ic->events = *p++;
+			break;
+		case IpcRestart:
+			restart(&arg);
+			break;
+		default:
+			goto bad;
+		}
+	}
+	return;
+bad:
+	r->status = IpcBadCommand;
 }
 
+/* Splits len bytes of NUL terminated strings into a NULL terminated
+ * argv, returns the number of strings or -1 if they don't fit. */
+int
+ipcargv(unsigned char *p, size_t len, char **argv, int max)
+{
+	int n = 0;
+	size_t i;
+
+	if (!len || p[len - 1])
+		return -1;
+	for (i = 0; i < len; i += strlen((char *)p + i) + 1) {
+		if (n == max - 1)
+			return -1;
+		argv[n++] = (char *)p + i;
+	}
+	argv[n] = NULL;
+	return n;
+}
+
+/* Pushes an event to its subscribers. A subscriber whose buffer is full
+ * misses it rather than stalling the window manager. */
 void
-updateclientlist()
+ipcnotify(unsigned int ev, Window win)
 {
+	IpcMsg m = { .type = ev, .arg = win };
+	IpcClient *ic;
+
+	for (ic = ipcclients; ic; ic = ic->next)
+		if (ic->events & ev)
+			send(ic->watch.fd, &m, sizeof(m), MSG_DONTWAIT|MSG_NOSIGNAL);
+}
+
+void
+ipcclose(IpcClient *ic)
+{
+	IpcClient **pp;
+
+	for (pp = &ipcclients; *pp != ic; pp = &(*pp)->next);
+	*pp = ic->next;
+	unwatchfd(&ic->watch);
+	close(ic->watch.fd);
+	free(ic);
+}
+
+Class *
+getclass(const char *name, int create)
+{
+	Class *cls;
+	unsigned int h = classhash(name);
+
+	for (cls = classtab[h]; cls; cls = cls->next)
+		if (!strcmp(cls->name, name))
+			return cls;
+	if (!create)
+		return NULL;
+	cls = ecalloc(1, sizeof(Class));
+	strncpy(cls->name, name, sizeof cls->name - 1);
+	cls->next = classtab[h];
+	classtab[h] = cls;
+	return cls;
+}
+
+void
+attachclass(Client *c, const char *name)
+{
+	c->cls = getclass(name, 1);
+	c->cprev = NULL;
+	c->cnext = c->cls->clients;
+	if (c->cnext)
+		c->cnext->cprev = c;
+	c->cls->clients = c;
+}
+
+void
+detachclass(Client *c)
+{
+	Class **tc;
+
+	if (!c->cls)
+		return;
+	if (c->cprev)
+		c->cprev->cnext = c->cnext;
+	else
+		c->cls->clients = c->cnext;
+	if (c->cnext)
+		c->cnext->cprev = c->cprev;
+	if (!c->cls->clients) {
+		for (tc = &classtab[classhash(c->cls->name)]; *tc != c->cls; tc = &(*tc)->next);
+		*tc = c->cls->next;
+		free(c->cls);
+	}
+	c->cls = NULL;
+	c->cprev = c->cnext = NULL;
+}
+
+void
+promoteclass(Client *c)
+{
+	if (!c->cls || c->cls->clients == c)
+		return;
+	c->cprev->cnext = c->cnext;
+	if (c->cnext)
+		c->cnext->cprev = c->cprev;
+	c->cprev = NULL;
+	c->cnext = c->cls->clients;
+	c->cnext->cprev = c;
+	c->cls->clients = c;
+}
+
+void
+updateclass(Client *c, xcb_get_property_reply_t *r)
+{
+	char name[sizeof ((Class *)0)->name] = "";
+	const char *p;
+	int len, n;
+
+	/* WM_CLASS is "res_name\0res_class\0" */
+	if (r && r->format == 8 && (len = xcb_get_property_value_length(r)) > 0) {
+		p = xcb_get_property_value(r);
+		for (n = 0; n < len && p[n]; n++);
+		if (++n < len)
+			snprintf(name, sizeof name, "%.*s", len - n, p + n);
+	}
+	if (c->cls ? !strcmp(c->cls->name, name) : !*name)
+		return;
+	detachclass(c);
+	/* classless clients are in no class, runorraise cannot match them */
+	if (*name)
+		attachclass(c, name);
+}
+
+void
+propertynotify(XEvent *e)
+{
+	Client *c;
+	XPropertyEvent *ev = &e->xproperty;
+	xcb_get_property_cookie_t ck;
+	xcb_get_property_reply_t *r;
+
+	if (ev->state == PropertyDelete || !(c = wintoclient(ev->window)))
+		return;
+	/* Most properties are only marked here and reread by whatever uses
+	 * them next, however often they change in between. */
+	if (ev->atom == XA_WM_NAME || ev->atom == netatom[NetWMName]) {
+		c->stale |= StaleTitle;
+		if (c == c->mon->sel)
+			markbar(c->mon, SegTitle);
+	} else if (ev->atom == XA_WM_HINTS)
+		c->stale |= StaleHints;
+	else if (ev->atom == wmatom[WMProtocols])
+		c->stale |= StaleProtocols;
+	else if (ev->atom == netatom[NetWMWindowType])
+		c->stale |= StaleType;
+	else if (ev->atom == XA_WM_CLASS) {
+		ck = xcb_get_property(xcon, 0, c->win, XA_WM_CLASS,
+			XCB_GET_PROPERTY_TYPE_ANY, 0, 2 * sizeof c->cls->name / 4);
+		SENT(ck.sequence, "GetProperty");
+		r = ROUNDTRIP(xcb_get_property_reply(xcon, ck, NULL));
+		updateclass(c, r);
+		free(r);
+		markbar(c->mon, SegFrame);
+	}
+}
+
+
+/* creates or moves the mode line of m, all of which is redrawn */
+void
+updatebar(Monitor *m)
+{
+	XSetWindowAttributes wa = {
+		.override_redirect = True,
+		.background_pixmap = ParentRelative,
+		.event_mask = ButtonPressMask|ExposureMask
+	};
+	int i;
+
+	if (!showbar)
+		return;
+	if (!m->barwin) {
+		m->barwin = XCreateWindow(dpy, root, m->wx, m->by, m->ww, bh, 0,
+			DefaultDepth(dpy, screen), CopyFromParent, DefaultVisual(dpy, screen),
+			CWOverrideRedirect|CWBackPixmap|CWEventMask, &wa);
+		XDefineCursor(dpy, m->barwin, cursor[CurNormal]->cursor);
+		XMapRaised(dpy, m->barwin);
+	} else
+		XMoveResizeWindow(dpy, m->barwin, m->wx, m->by, m->ww, bh);
+	for (i = 0; i < SegLast; i++) {
+		m->seg[i].w = 0;
+		markbar(m, i);
+	}
+}
+
+/* Marks a segment of the mode line of m as damaged. Damage is repaired
+ * at most every bardelay, however often it comes. */
+void
+markbar(Monitor *m, int seg)
+{
+	m->seg[seg].dirty = 1;
+	if (!bartimer.pprev)
+		armtimer(&bartimer, bardelay);
+}
+
+/* Redraws the damaged segments of the mode line of m and copies only
+ * those to the window. A segment that changes width moves or resizes
+ * its neighbours, which are redrawn as well. */
+void
+drawbar(Monitor *m)
+{
+	Segment *seg = m->seg;
 	Client *c;
+	Refresh *r;
+	int i, n, x, w[SegLast];
+	const char *label;
+
+	if (!m->barwin)
+		return;
+	/* the titles shown that changed are reread in one round trip */
+	n = seg[SegTitle].dirty && m->sel;
+	if (seg[SegFrame].dirty)
+		for (c = m->selframe->clients; c; c = c->fnext)
+			n += !c->cls && (c->stale & StaleTitle);
+	if (n) {
+		r = ecalloc(n, sizeof(Refresh));
+		n = 0;
+		if (seg[SegFrame].dirty)
+			for (c = m->selframe->clients; c; c = c->fnext)
+				if (!c->cls && (c->stale & StaleTitle))
+					refreshrequest(&r[n++], c, StaleTitle);
+		if (seg[SegTitle].dirty && m->sel && (m->sel->stale & StaleTitle)) {
+			for (i = 0; i < n && r[i].c != m->sel; i++);
+			if (i == n)
+				refreshrequest(&r[n++], m->sel, StaleTitle);
+		}
+		if (n)
+			ROUNDTRIP(refreshreply(&r[0]));
+		for (i = 1; i < n; i++)
+			refreshreply(&r[i]);
+		free(r);
+	}
+	for (i = 0; i < SegLast; i++)
+		w[i] = seg[i].w;
+	if (seg[SegFrame].dirty)
+		for (w[SegFrame] = 0, c = m->selframe->clients; c; c = c->fnext)
+			w[SegFrame] += TEXTW(c->cls ? c->cls->name : c->name);
+	w[SegFrame] = MIN(w[SegFrame], m->ww / 3);
+	if (seg[SegLoad].dirty)
+		w[SegLoad] = TEXTW(loadtext);
+	if (seg[SegClock].dirty)
+		w[SegClock] = TEXTW(clocktext);
+	w[SegTitle] = MAX(0, m->ww - w[SegFrame] - w[SegLoad] - w[SegClock]);
+	for (i = 0, x = 0; i < SegLast; x += w[i++])
+		if (seg[i].x != x || seg[i].w != w[i]) {
+			seg[i].x = x;
+			seg[i].w = w[i];
+			seg[i].dirty = 1;
+		}
+
+	drw_resize(drw, m->ww, bh);
+	drw_setscheme(drw, scheme[SchemeNorm]);
+	for (i = 0; i < SegLast; i++) {
+		if (!seg[i].dirty || !seg[i].w) {
+			seg[i].dirty = 0;
+			continue;
+		}
+		switch (i) {
+		case SegFrame:
+			/* the clients of the selected frame, its shown one inverted */
+			for (x = seg[i].x, c = m->selframe->clients; c && x < seg[i].x + seg[i].w; c = c->fnext) {
+				label = c->cls ? c->cls->name : c->name;
+				x = drw_text(drw, x, 0, MIN(TEXTW(label), seg[i].x + seg[i].w - x), bh,
+					lrpad / 2, label, c == m->selframe->sel);
+			}
+			if (x < seg[i].x + seg[i].w)
+				drw_rect(drw, x, 0, seg[i].x + seg[i].w - x, bh, 1, 1);
+			break;
+		case SegTitle:
+			drw_text(drw, seg[i].x, 0, seg[i].w, bh, lrpad / 2,
+				m->sel ? m->sel->name : "", 0);
+			break;
+		case SegLoad:
+			drw_text(drw, seg[i].x, 0, seg[i].w, bh, lrpad / 2, loadtext, 0);
+			break;
+		case SegClock:
+			drw_text(drw, seg[i].x, 0, seg[i].w, bh, lrpad / 2, clocktext, 0);
+			break;
+		}
+		drw_map(drw, m->barwin, seg[i].x, 0, seg[i].w, bh);
+		seg[i].dirty = 0;
+	}
+}
+
+void
+drawbars(void)
+{
 	Monitor *m;
 
-	XDeleteProperty(dpy, root, netatom[NetClientList]);
 	for (m = mons; m; m = m->next)
-		for (c = m->clients; c; c = c->next)
-			XChangeProperty(dpy, root, netatom[NetClientList],
-				XA_WINDOW, 32, PropModeAppend,
-				(unsigned char *) &(c->win), 1);
+		drawbar(m);
 }
 
-
+/* refreshes the clock and the load average, only what changed is drawn */
 void
-runorraise(const Arg *arg)
+updatestatus(void)
 {
-	char *app = ((char **)arg->v)[4];
-	Arg a = { .ui = ~0 };
-	Monitor *mon;
-	Client *c;
-	XClassHint hint = { NULL, NULL };
-	for (mon = mons; mon; mon = mon->next) {
-		for (c = mon->clients; c; c = c->next) {
-			XGetClassHint(dpy, c->win, &hint);
-			if (hint.res_class && strcmp(app, hint.res_class) == 0) {
-				focus(c);
-				return;
-			}
-		}
+	char buf[MAX(sizeof clocktext, sizeof loadtext)];
+	double avg[3];
+	time_t t = time(NULL);
+	Monitor *m;
+
+	if (!strftime(buf, sizeof clocktext, clockfmt, localtime(&t)))
+		buf[0] = '\0';
+	if (strcmp(buf, clocktext)) {
+		strcpy(clocktext, buf);
+		for (m = mons; m; m = m->next)
+			markbar(m, SegClock);
+	}
+	if (getloadavg(avg, 3) < 3)
+		buf[0] = '\0';
+	else
+		snprintf(buf, sizeof loadtext, "%.2f %.2f %.2f", avg[0], avg[1], avg[2]);
+	if (strcmp(buf, loadtext)) {
+		strcpy(loadtext, buf);
+		for (m = mons; m; m = m->next)
+			markbar(m, SegLoad);
 	}
-	spawn(arg);
+	armtimer(&statustimer, statusinterval);
 }
 
+void
+expose(XEvent *e)
+{
+	XExposeEvent *ev = &e->xexpose;
+	Monitor *m;
+	int i;
+
+	if (ev->count == 0 && (m = wintomon(ev->window)) && ev->window == m->barwin)
+		for (i = 0; i < SegLast; i++)
+			markbar(m, i);
+}
 
 void
 unmapnotify(XEvent *e)
@@ -725,36 +2794,49 @@ setclientstate(Client *c, long state)
 }
 
 void
-updatetitle(Client *c)
+updatetitle(Client *c, xcb_get_property_reply_t *netname, xcb_get_property_reply_t *name)
 {
-	if (!gettextprop(c->win, netatom[NetWMName], c->name, sizeof c->name))
-		gettextprop(c->win, XA_WM_NAME, c->name, sizeof c->name);
+	if (!gettextprop(netname, c->name, sizeof c->name))
+		gettextprop(name, c->name, sizeof c->name);
 	if (c->name[0] == '\0') /* hack to mark broken clients */
 		strcpy(c->name, broken);
 }
 
 int
-gettextprop(Window w, Atom atom, char *text, unsigned int size)
+gettextprop(xcb_get_property_reply_t *r, char *text, unsigned int size)
 {
-	char **list = NULL;
-	int n;
+	char **list = NULL, *p;
+	int n, len;
 	XTextProperty name;
 
 	if (!text || size == 0)
 		return 0;
 	text[0] = '\0';
-	if (!XGetTextProperty(dpy, w, &name, atom) || !name.nitems)
+	if (!r || r->format != 8 || !(len = xcb_get_property_value_length(r)))
 		return 0;
-	if (name.encoding == XA_STRING)
-		strncpy(text, (char *)name.value, size - 1);
-	else {
-		if (XmbTextPropertyToTextList(dpy, &name, &list, &n) >= Success && n > 0 && *list) {
-			strncpy(text, *list, size - 1);
-			XFreeStringList(list);
-		}
+	p = xcb_get_property_value(r);
+	if (r->type != XA_STRING && r->type != utf8string) {
+		/* compound text, converted locally from the reply we already have */
+		name.value = (unsigned char *)p;
+		name.encoding = r->type;
+		name.format = r->format;
+		name.nitems = len;
+		if (XmbTextPropertyToTextList(dpy, &name, &list, &n) >= Success && n > 0 && *list)
+			len = strlen(p = *list);
+		else
+			len = 0;
+	}
+	if (len > size - 1) {
+		len = size - 1;
+		/* cut before a multibyte sequence, not within it */
+		if (r->type != XA_STRING)
+			while (len > 0 && (p[len] & 0xc0) == 0x80)
+				len--;
 	}
-	text[size - 1] = '\0';
-	XFree(name.value);
+	memcpy(text, p, len);
+	text[len] = '\0';
+	if (list)
+		XFreeStringList(list);
 	return 1;
 }
 
@@ -791,28 +2873,23 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
 }
 
 int
-sendevent(Client *c, Atom proto)
+sendevent(Client *c, int proto)
 {
-	int n;
-	Atom *protocols;
-	int exists = 0;
 	XEvent ev;
 
-	if (XGetWMProtocols(dpy, c->win, &protocols, &n)) {
-		while (!exists && n--)
-			exists = protocols[n] == proto;
-		XFree(protocols);
-	}
-	if (exists) {
-		ev.type = ClientMessage;
-		ev.xclient.window = c->win;
-		ev.xclient.message_type = wmatom[WMProtocols];
-		ev.xclient.format = 32;
-		ev.xclient.data.l[0] = proto;
-		ev.xclient.data.l[1] = CurrentTime;
-		XSendEvent(dpy, c->win, False, NoEventMask, &ev);
-	}
-	return exists;
+	/* WM_PROTOCOLS is read on adoption and after it changed, not on
+	 * every send */
+	refresh(c, StaleProtocols);
+	if (!(c->protocols & (1 << proto)))
+		return 0;
+	ev.type = ClientMessage;
+	ev.xclient.window = c->win;
+	ev.xclient.message_type = wmatom[WMProtocols];
+	ev.xclient.format = 32;
+	ev.xclient.data.l[0] = wmatom[proto];
+	ev.xclient.data.l[1] = CurrentTime;
+	XSendEvent(dpy, c->win, False, NoEventMask, &ev);
+	return 1;
 }
 
 void
@@ -820,17 +2897,19 @@ stopclient(const Arg *arg)
 {
 	if (!selmon->sel)
 		return;
-	sendevent(selmon->sel, wmatom[WMDelete]);
+	sendevent(selmon->sel, WMDelete);
 }
 
 void
 killclient(const Arg *arg)
 {
+	if (!selmon->sel)
+		return;
 	XGrabServer(dpy);
 	XSetErrorHandler(xerrordummy);
 	XSetCloseDownMode(dpy, DestroyAll);
 	XKillClient(dpy, selmon->sel->win);
-	XSync(dpy, False);
+	xsync();
 	XSetErrorHandler(xerror);
 	XUngrabServer(dpy);
 }
@@ -903,89 +2982,495 @@ configurerequest(XEvent *e)
 		wc.stack_mode = ev->detail;
 		XConfigureWindow(dpy, ev->window, ev->value_mask, &wc);
 	}
-	XSync(dpy, False);
 }
 
 
 void
 nextclient(const Arg *arg)
 {
+	Frame *f = selmon->selframe;
 	Client *c;
-	if (!selmon->clients) return;
-	if (selmon->sel == selmon->clients)
-		for (c = selmon->clients; c->next; c = c->next);
+
+	if (!f->clients) return;
+	if (f->sel == f->clients)
+		for (c = f->clients; c->fnext; c = c->fnext);
 	else
-		for (c = selmon->clients; c->next != selmon->sel ; c = c->next);
-	if (c) focus(c);
+		for (c = f->clients; c->fnext != f->sel; c = c->fnext);
+	focus(c);
 }
 
 void
 prevclient(const Arg *arg)
 {
-	if (!selmon->sel) return;
-	if (selmon->sel->next)
-		focus(selmon->sel->next);
+	Frame *f = selmon->selframe;
+
+	if (!f->sel) return;
+	if (f->sel->fnext)
+		focus(f->sel->fnext);
+	else
+		focus(f->clients);
+}
+
+/* focuses the arg->i th most recent client, 0 being the focused one */
+void
+jumpclient(const Arg *arg)
+{
+	Client *c;
+	int i;
+
+	for (i = 0, c = lastclient; c && i < arg->i; c = c->hnext, i++);
+	if (c)
+		focus(c);
+}
+
+/* Steps through the history like Alt-Tab: the order is kept until the
+ * chord ends, then the client landed on is promoted. */
+void
+cyclehistory(const Arg *arg)
+{
+	Client *c = cyclesel ? cyclesel : lastclient;
+
+	if (!c)
+		return;
+	if (arg->i > 0)
+		c = c->hnext ? c->hnext : lastclient;
 	else
-		focus(selmon->clients);
+		c = c->hprev ? c->hprev : firstclient;
+	cyclesel = c;
+	focus(c);
 }
 
 void
-selclient(const Arg *arg)
+endcycle(void)
 {
-	if (lastclient && lastclient->snext)
-		focus(lastclient->snext);
+	Client *c;
+
+	if ((c = cyclesel)) {
+		cyclesel = NULL;
+		promote(c);
+	}
 }
 
 void
 nextframe(const Arg *arg)
 {
-	/* FIXME: Operate on frames not on monitors */
+	Frame *f;
+	Monitor *m;
+
+	if (!(f = nextleaf(selmon->selframe, 1))) {
+		m = selmon->next ? selmon->next : mons;
+		for (f = m->frames; f->split; f = f->child[0]);
+	}
+	focusframe(f);
+}
 
+void
+prevframe(const Arg *arg)
+{
+	Frame *f;
 	Monitor *m;
 
-	if (selmon->next) m = selmon->next;
-	else m = mons;
+	if (!(f = nextleaf(selmon->selframe, 0))) {
+		for (m = mons; m->next && m->next != selmon; m = m->next);
+		for (f = m->frames; f->split; f = f->child[1]);
+	}
+	focusframe(f);
+}
+
+/* the leaf after f (dir 1) or before it (dir 0) in the tree of its
+ * monitor, NULL at the ends */
+Frame *
+nextleaf(Frame *f, int dir)
+{
+	int i = dir ? 1 : 0;
+
+	while (f->parent && f->parent->child[i] == f)
+		f = f->parent;
+	if (!f->parent)
+		return NULL;
+	for (f = f->parent->child[i]; f->split; f = f->child[!i]);
+	return f;
+}
+
+void
+focusframe(Frame *f)
+{
 	unfocus(selmon->sel, 0);
-	selmon = m;
+	selmon = f->mon;
+	selmon->selframe = f;
 	focus(NULL);
 }
 
+Frame *
+createframe(Monitor *m)
+{
+	Frame *f = slab_alloc(frameslab);
+
+	f->mon = m;
+	f->ratio = 0.5;
+	return f;
+}
+
 void
-prevframe(const Arg *arg)
+freeframes(Frame *f)
 {
-	/* FIXME: Operate on frames not on monitors */
+	if (f->split) {
+		freeframes(f->child[0]);
+		freeframes(f->child[1]);
+	}
+	slab_free(frameslab, f);
+}
 
-	Monitor *m;
-	
-	if (selmon->next) m = selmon->next;
-	else m = mons;
-	unfocus(selmon->sel, 0);
-	selmon = m;
+void
+attachframe(Client *c, Frame *f)
+{
+	c->frame = f;
+	c->fnext = f->clients;
+	f->clients = c;
+	if (!f->sel)
+		f->sel = c;
+	markbar(f->mon, SegFrame);
+}
+
+/* also picks the next client f shows, so c must be off the stack */
+void
+detachframe(Client *c)
+{
+	Frame *f = c->frame;
+	Client **tc, *t;
+
+	for (tc = &f->clients; *tc && *tc != c; tc = &(*tc)->fnext);
+	*tc = c->fnext;
+	c->fnext = NULL;
+	if (f->sel == c) {
+		for (t = c->mon->stack; t && t->frame != f; t = t->snext);
+		f->sel = t ? t : f->clients;
+	}
+	markbar(f->mon, SegFrame);
+}
+
+/* Lays out the subtree of f in its current area. Only the clients whose
+ * geometry changes are reconfigured. */
+void
+arrange(Frame *f)
+{
+	Client *c;
+	Refresh *r;
+	int i, n, s;
+
+	if (!f->split) {
+		/* window types that changed are reread in one round trip */
+		for (n = 0, c = f->clients; c; c = c->fnext)
+			n += (c->stale & StaleType) != 0;
+		if (n) {
+			r = ecalloc(n, sizeof(Refresh));
+			for (n = 0, c = f->clients; c; c = c->fnext)
+				if (c->stale & StaleType)
+					refreshrequest(&r[n++], c, StaleType);
+			ROUNDTRIP(refreshreply(&r[0]));
+			for (i = 1; i < n; i++)
+				refreshreply(&r[i]);
+			free(r);
+		}
+		for (c = f->clients; c; c = c->fnext)
+			if (!c->isfloating && !c->isfullscreen)
+				resize(c, f->x, f->y, f->w - 2 * c->bw, f->h - 2 * c->bw, 0);
+		return;
+	}
+	if (f->split == SplitH) {
+		s = f->w * f->ratio + 0.5;
+		placeframe(f->child[0], f->x, f->y, s, f->h);
+		placeframe(f->child[1], f->x + s, f->y, f->w - s, f->h);
+	} else {
+		s = f->h * f->ratio + 0.5;
+		placeframe(f->child[0], f->x, f->y, f->w, s);
+		placeframe(f->child[1], f->x, f->y + s, f->w, f->h - s);
+	}
+}
+
+/* moves f, subtrees whose area is unchanged are left alone */
+void
+placeframe(Frame *f, int x, int y, int w, int h)
+{
+	if (f->x == x && f->y == y && f->w == w && f->h == h)
+		return;
+	f->x = x;
+	f->y = y;
+	f->w = w;
+	f->h = h;
+	arrange(f);
+}
+
+/* Sets the geometry of m and marks it for configurenotify to lay out.
+ * The frames get what the mode line leaves. */
+void
+placemon(Monitor *m, int x, int y, int w, int h)
+{
+	m->dirty = 1;
+	m->mx = m->wx = x;
+	m->my = m->wy = y;
+	m->mw = m->ww = w;
+	m->mh = m->wh = h;
+	if (showbar) {
+		m->wh -= bh;
+		m->by = topbar ? m->wy : m->wy + m->wh;
+		m->wy = topbar ? m->wy + bh : m->wy;
+	}
+	m->frames->x = m->wx;
+	m->frames->y = m->wy;
+	m->frames->w = m->ww;
+	m->frames->h = m->wh;
+}
+
+/* Splits the selected frame in two like StumpWM: it keeps its clients
+ * and focus, the new frame gets the next most recent of them. */
+void
+splitframe(int split)
+{
+	Frame *f = selmon->selframe, *p, *n;
+	Client *c;
+
+	if ((split == SplitH ? f->w : f->h) < 2 * framemin)
+		return;
+	p = createframe(selmon);
+	n = createframe(selmon);
+	p->x = f->x;
+	p->y = f->y;
+	p->w = f->w;
+	p->h = f->h;
+	p->split = split;
+	p->parent = f->parent;
+	if (f->parent)
+		f->parent->child[f->parent->child[1] == f] = p;
+	else
+		selmon->frames = p;
+	p->child[0] = f;
+	p->child[1] = n;
+	f->parent = n->parent = p;
+	for (c = selmon->stack; c && (c->frame != f || c == f->sel || c->isfloating); c = c->snext);
+	if (c) {
+		detachframe(c);
+		attachframe(c, n);
+	}
+	arrange(p);
+}
+
+void
+hsplit(const Arg *arg)
+{
+	splitframe(SplitH);
+}
+
+void
+vsplit(const Arg *arg)
+{
+	splitframe(SplitV);
+}
+
+/* Removes the selected frame. Its sibling takes the parent's area and
+ * the nearest leaf of it takes the clients. */
+void
+removeframe(const Arg *arg)
+{
+	Frame *f = selmon->selframe, *p = f->parent, *s, *t;
+	Client *c;
+	int i;
+
+	if (!p)
+		return;
+	i = p->child[1] == f;
+	s = p->child[!i];
+	s->parent = p->parent;
+	if (p->parent)
+		p->parent->child[p->parent->child[1] == p] = s;
+	else
+		selmon->frames = s;
+	for (t = s; t->split; t = t->child[i]);
+	while ((c = f->clients)) {
+		f->clients = c->fnext;
+		c->frame = t;
+		c->fnext = t->clients;
+		t->clients = c;
+	}
+	if (!t->sel)
+		t->sel = f->sel;
+	selmon->selframe = t;
+	placeframe(s, p->x, p->y, p->w, p->h);
+	arrange(t); /* for the clients moved in */
+	slab_free(frameslab, f);
+	slab_free(frameslab, p);
 	focus(NULL);
 }
 
+/* Moves the nearest split of the given kind above the selected frame by
+ * d pixels, growing the selected side for d > 0. */
+void
+resizeframe(int split, int d)
+{
+	Frame *f, *p;
+	float size, r;
+
+	for (f = selmon->selframe; (p = f->parent) && p->split != split; f = p);
+	if (!p)
+		return;
+	size = split == SplitH ? p->w : p->h;
+	r = p->ratio + (p->child[0] == f ? d : -d) / size;
+	r = MAX(r, framemin / size);
+	r = MIN(r, 1 - framemin / size);
+	if (r == p->ratio)
+		return;
+	p->ratio = r;
+	arrange(p);
+}
+
+void
+hresize(const Arg *arg)
+{
+	resizeframe(SplitH, arg->i);
+}
+
+void
+vresize(const Arg *arg)
+{
+	resizeframe(SplitV, arg->i);
+}
+
+void
+adoptrequest(Adoption *a, Window w)
+{
+	int i;
+
+	memset(a, 0, sizeof(Adoption));
+	a->win = w;
+	a->attrck = xcb_get_window_attributes(xcon, w);
+	SENT(a->attrck.sequence, "GetWindowAttributes");
+	a->geomck = xcb_get_geometry(xcon, w);
+	SENT(a->geomck.sequence, "GetGeometry");
+	for (i = 0; i < PropLast; i++) {
+		a->propck[i] = xcb_get_property(xcon, 0, w, propatom[i],
+			XCB_GET_PROPERTY_TYPE_ANY, 0, proplen[i]);
+		SENT(a->propck[i].sequence, "GetProperty");
+	}
+}
+
+int
+adoptreply(Adoption *a)
+{
+	xcb_generic_error_t *err = NULL;
+	int i;
+
+	/* the window may be gone by now, collect every reply regardless,
+	 * they all arrive with the first */
+	a->attr = xcb_get_window_attributes_reply(xcon, a->attrck, &err);
+	free(err);
+	err = NULL;
+	a->geom = xcb_get_geometry_reply(xcon, a->geomck, &err);
+	free(err);
+	for (i = 0; i < PropLast; i++) {
+		err = NULL;
+		a->prop[i] = xcb_get_property_reply(xcon, a->propck[i], &err);
+		free(err);
+	}
+	return a->attr && a->geom;
+}
+
 void
-manage(Window w, XWindowAttributes *wa)
+adoptfree(Adoption *a)
+{
+	int i;
+
+	free(a->attr);
+	free(a->geom);
+	for (i = 0; i < PropLast; i++)
+		free(a->prop[i]);
+}
+
+/* Sends the requests to reread the fields in mask that went stale.
+ * Requests for several clients can go out before the first reply is
+ * collected, so that they share one round trip. */
+void
+refreshrequest(Refresh *r, Client *c, unsigned int mask)
+{
+	int i, p;
+
+	r->c = c;
+	r->stale = c->stale & mask;
+	for (i = 0; i < LENGTH(staleprops); i++)
+		if (r->stale & staleprops[i].stale) {
+			p = staleprops[i].prop;
+			r->propck[p] = xcb_get_property(xcon, 0, c->win, propatom[p],
+				XCB_GET_PROPERTY_TYPE_ANY, 0, proplen[p]);
+			SENT(r->propck[p].sequence, "GetProperty");
+		}
+}
+
+void
+refreshreply(Refresh *r)
+{
+	xcb_get_property_reply_t *prop[PropLast] = { NULL };
+	Client *c = r->c;
+	int i;
+
+	for (i = 0; i < LENGTH(staleprops); i++)
+		if (r->stale & staleprops[i].stale)
+			prop[staleprops[i].prop] = xcb_get_property_reply(xcon,
+				r->propck[staleprops[i].prop], NULL);
+	c->stale &= ~r->stale;
+	if (r->stale & StaleTitle)
+		updatetitle(c, prop[PropNetWMName], prop[PropWMName]);
+	if (r->stale & StaleHints)
+		updatewmhints(c, prop[PropWMHints]);
+	if (r->stale & StaleProtocols)
+		updateprotocols(c, prop[PropWMProtocols]);
+	if (r->stale & StaleType)
+		updatewindowtype(c, NULL, prop[PropWindowType]);
+	for (i = 0; i < PropLast; i++)
+		free(prop[i]);
+}
+
+/* rereads the fields of c in mask if they went stale */
+void
+refresh(Client *c, unsigned int mask)
+{
+	Refresh r;
+
+	if (!(c->stale & mask))
+		return;
+	refreshrequest(&r, c, mask);
+	ROUNDTRIP(refreshreply(&r));
+}
+
+/* manages the adopted window, focusing it is left to the caller */
+Client *
+manage(Adoption *a)
 {
 	Client *c, *t = NULL;
 	Window trans = None;
 	XWindowChanges wc;
-	
-	c = ecalloc(1, sizeof(Client));
+	xcb_get_property_reply_t *r;
+	Window w = a->win;
+
+	c = slab_alloc(clientslab);
 	c->win = w;
 	/* geometry */
-	c->x = c->oldx = wa->x;
-	c->y = c->oldy = wa->y;
-	c->w = c->oldw = wa->width;
-	c->h = c->oldh = wa->height;
-	
-	c->oldbw = wa->border_width;
-
-	updatetitle(c);
-	if (XGetTransientForHint(dpy, w, &trans) && (t = wintoclient(trans)))
+	c->x = c->oldx = a->geom->x;
+	c->y = c->oldy = a->geom->y;
+	c->w = c->oldw = a->geom->width;
+	c->h = c->oldh = a->geom->height;
+
+	c->oldbw = a->geom->border_width;
+
+	updatetitle(c, a->prop[PropNetWMName], a->prop[PropWMName]);
+	updateprotocols(c, a->prop[PropWMProtocols]);
+	updateclass(c, a->prop[PropWMClass]);
+	if ((r = a->prop[PropTransient]) && r->format == 32 && xcb_get_property_value_length(r) >= 4)
+		trans = *(uint32_t *)xcb_get_property_value(r);
+	if (trans != None && (t = wintoclient(trans))) {
 		c->mon = t->mon;
-        else {
+		c->frame = t->frame;
+	} else {
 		c->mon = selmon;
+		c->frame = selmon->selframe;
 	}
 
 	if (c->x + WIDTH(c) > c->mon->mx + c->mon->mw)
@@ -1001,29 +3486,281 @@ manage(Window w, XWindowAttributes *wa)
 	XConfigureWindow(dpy, w, CWBorderWidth, &wc);
 	XSetWindowBorder(dpy, w, scheme[SchemeNorm][ColBorder].pixel);
 	configure(c); /* propagates border_width, if size doesn't change */
-	updatewindowtype(c);
-	updatewmhints(c);
+	updatewindowtype(c, a->prop[PropNetWMState], a->prop[PropWindowType]);
+	updatewmhints(c, a->prop[PropWMHints]);
 	XSelectInput(dpy, w, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
 	
 	if (!c->isfloating) {
-		resize(c, c->mon->wx, c->mon->wy, c->mon->ww - 2 * c->bw, c->mon->wh - 2 * c->bw, 0);
+		resize(c, c->frame->x, c->frame->y, c->frame->w - 2 * c->bw, c->frame->h - 2 * c->bw, 0);
 		c->isfloating = c->oldstate = trans != None || c->isfixed;
 	}
 	
 	if (c->isfloating) {
-		XRaiseWindow(dpy, c->win);
+		raiseclient(c);
 		resize(c, c->x, c->y, c->w, c->h, 0);
 	}
 		
 	attach(c);
 	attachstack(c);
-	XChangeProperty(dpy, root, netatom[NetClientList], XA_WINDOW, 32, PropModeAppend,
-		(unsigned char *) &(c->win), 1);
+	attachframe(c, c->frame);
+	indexclient(c);
+	listclient(c);
 
-	
 	setclientstate(c, NormalState);
 	XMapWindow(dpy, c->win);
-	c->mon->sel = c;
+	ipcnotify(IpcEvMap, c->win);
+	c->frame->sel = c;
+	return c;
+}
+
+/* Reads a client saved by putframe. It is taken over as it was if its
+ * window is among the n in wins, without asking the server about it. */
+Client *
+getclient(Blob *b, xcb_window_t *wins, int n)
+{
+	Client *c = slab_alloc(clientslab);
+	int *v[] = CLIENTINTS(c);
+	char cls[sizeof ((Class *)0)->name];
+	XWindowChanges wc;
+	int i;
+
+	c->win = get32(b);
+	for (i = 0; i < LENGTH(v); i++)
+		*v[i] = (int32_t)get32(b);
+	c->protocols = get32(b);
+	getstr(b, c->name, sizeof(c->name));
+	getstr(b, cls, sizeof(cls));
+	for (i = 0; i < n && wins[i] != c->win; i++);
+	if (b->bad || i == n || wintoclient(c->win)) {
+		slab_free(clientslab, c);
+		return NULL;
+	}
+	if (*cls)
+		attachclass(c, cls);
+	indexclient(c);
+	/* changes while no kwm listened went unnoticed, reread on use */
+	c->stale = StaleTitle|StaleHints|StaleProtocols|StaleType;
+	XSelectInput(dpy, c->win, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
+	XSetWindowBorder(dpy, c->win, scheme[SchemeNorm][ColBorder].pixel);
+	/* borderpx may have changed along with kwm */
+	if (!c->isfullscreen && c->bw != borderpx) {
+		c->bw = wc.border_width = borderpx;
+		XConfigureWindow(dpy, c->win, CWBorderWidth, &wc);
+	}
+	return c;
+}
+
+/* Reads a subtree saved by putframe into m, depth levels down. With
+ * into set the frames are read but not made, and their clients go to
+ * into. Anyone can write _KWM_STATE, so the depth is bounded. */
+Frame *
+getframe(Blob *b, Monitor *m, Frame *parent, Frame *into, int depth, xcb_window_t *wins, int n)
+{
+	Frame *f = NULL, *child;
+	Client *c, *next;
+	Window sel;
+	float ratio;
+	uint32_t split, i, nc;
+
+	if ((split = get32(b)) > SplitV || (split && depth >= STATEDEPTH))
+		b->bad = 1;
+	if (b->bad)
+		split = SplitNone;
+	get(b, &ratio, sizeof(ratio));
+	if (!into) {
+		f = createframe(m);
+		f->parent = parent;
+		f->split = split;
+		if (ratio > 0 && ratio < 1)
+			f->ratio = ratio;
+	}
+	if (split) {
+		for (i = 0; i < 2; i++) {
+			child = getframe(b, m, f, into, depth + 1, wins, n);
+			if (f)
+				f->child[i] = child;
+		}
+		return f;
+	}
+	if (get32(b) && f)
+		m->selframe = f;
+	sel = get32(b);
+	nc = get32(b);
+	for (i = 0; i < nc && !b->bad; i++)
+		if ((c = getclient(b, wins, n))) {
+			c->mon = m;
+			attach(c);
+			attachstack(c);
+			attachframe(c, f ? f : into);
+			listclient(c);
+		}
+	if (!f)
+		return NULL;
+	/* attachframe put them in reverse */
+	for (c = f->clients, f->clients = NULL; c; c = next) {
+		next = c->fnext;
+		c->fnext = f->clients;
+		f->clients = c;
+	}
+	if ((c = wintoclient(sel)) && c->frame == f)
+		f->sel = c;
+	return f;
+}
+
+/* Takes over the clients saved by restart whose windows are among the n
+ * in wins, and puts back the frames, focus and histories they had.
+ * Monitors that are gone hand their clients to the first one. */
+void
+restore(Blob *b, xcb_window_t *wins, int n)
+{
+	Monitor *m, *sm = NULL;
+	Frame *f;
+	Client *c;
+	Window *w, sel;
+	uint32_t i, j, nmons, nw, out, issel;
+
+	if (get32(b) != STATEMAGIC)
+		return;
+	nmons = get32(b);
+	for (i = 0; i < nmons && !b->bad; i++) {
+		out = get32(b);
+		issel = get32(b);
+		sel = get32(b);
+		for (m = mons; m && m->output != out; m = m->next);
+		if (!m) {
+			m = mons;
+			getframe(b, m, NULL, m->selframe, 0, wins, n);
+		} else {
+			/* the leaf setup made, maybe given clients by the above */
+			f = m->frames;
+			m->selframe = NULL;
+			m->frames = getframe(b, m, NULL, NULL, 0, wins, n);
+			if (!m->selframe)
+				for (m->selframe = m->frames; m->selframe->split;
+				     m->selframe = m->selframe->child[0]);
+			while ((c = f->clients)) {
+				f->clients = c->fnext;
+				attachframe(c, m->selframe);
+			}
+			freeframes(f);
+			m->frames->x = m->wx;
+			m->frames->y = m->wy;
+			m->frames->w = m->ww;
+			m->frames->h = m->wh;
+			if (issel)
+				sm = m;
+			if ((c = wintoclient(sel)) && c->mon == m)
+				m->sel = c;
+		}
+		/* the histories and lists are put back in their saved order */
+		w = getwins(b, &nw);
+		for (j = nw; j-- > 0;) {
+			c = wintoclient(w[j]);
+			detach(c);
+			attach(c);
+		}
+		free(w);
+	}
+	w = getwins(b, &nw);
+	for (j = nw; j-- > 0;)
+		promote(wintoclient(w[j]));
+	free(w);
+	w = getwins(b, &nw);
+	if (nw && nw == nclientlist)
+		memcpy(clientlist, w, nw * sizeof(Window));
+	free(w);
+	w = getwins(b, &nw);
+	if (nw && nw == nclientlist)
+		memcpy(stacklist, w, nw * sizeof(Window));
+	free(w);
+	if (sm)
+		selmon = sm;
+	for (m = mons; m; m = m->next)
+		arrange(m->frames);
+	/* fullscreen clients go above the mode line, as they were, and so
+	 * does what was stacked on them, in the saved order */
+	for (j = 0; j < nclientlist && !((c = wintoclient(stacklist[j])) && c->isfullscreen); j++);
+	if ((nw = nclientlist - j)) {
+		w = ecalloc(nw, sizeof(Window));
+		memcpy(w, &stacklist[j], nw * sizeof(Window));
+		for (j = 0; j < nw; j++)
+			raiseclient(wintoclient(w[j]));
+		free(w);
+	}
+}
+
+/* Adopts the windows mapped before kwm started, in one batch: the
+ * requests for all of them go out together and are answered in one
+ * round trip. Transients are managed after the windows they belong to,
+ * and focus is set once at the end. After a restart the windows in the
+ * saved state are restored instead and skip the requests. */
+void
+scan(void)
+{
+	xcb_query_tree_cookie_t treeck;
+	xcb_query_tree_reply_t *tree;
+	xcb_get_property_cookie_t kwmck, *stateck;
+	xcb_get_property_reply_t *r;
+	xcb_window_t *wins;
+	Adoption *a;
+	Blob b = { 0 };
+	int i, n, ok, pass, first, *when;
+
+	treeck = xcb_query_tree(xcon, root);
+	SENT(treeck.sequence, "QueryTree");
+	/* left by restart, and deleted so a later kwm doesn't reuse it */
+	kwmck = xcb_get_property(xcon, 1, root, stateatom, stateatom, 0, STATEMAX / 4);
+	SENT(kwmck.sequence, "GetProperty");
+	if (!(tree = ROUNDTRIP(xcb_query_tree_reply(xcon, treeck, NULL)))) {
+		xcb_discard_reply(xcon, kwmck.sequence);
+		return;
+	}
+	n = xcb_query_tree_children_length(tree);
+	wins = xcb_query_tree_children(tree);
+	if ((r = xcb_get_property_reply(xcon, kwmck, NULL)) && r->format == 8) {
+		b.p = xcb_get_property_value(r);
+		b.size = xcb_get_property_value_length(r);
+		restore(&b, wins, n);
+	}
+	free(r);
+	a = ecalloc(MAX(n, 1), sizeof(Adoption));
+	stateck = ecalloc(MAX(n, 1), sizeof(xcb_get_property_cookie_t));
+	when = ecalloc(MAX(n, 1), sizeof(int)); /* pass to manage in, 0 for never */
+	for (i = 0; i < n; i++) {
+		if (wintoclient(wins[i]))
+			continue; /* restored */
+		adoptrequest(&a[i], wins[i]);
+		stateck[i] = xcb_get_property(xcon, 0, wins[i], wmatom[WMState],
+			wmatom[WMState], 0, 2);
+		SENT(stateck[i].sequence, "GetProperty");
+	}
+	for (i = 0, first = 1; i < n; i++) {
+		if (!a[i].win)
+			continue;
+		/* the rest arrive along with the first */
+		ok = first ? ROUNDTRIP(adoptreply(&a[i])) : adoptreply(&a[i]);
+		first = 0;
+		r = xcb_get_property_reply(xcon, stateck[i], NULL);
+		/* viewable, or iconic from an earlier window manager */
+		ok = ok && !a[i].attr->override_redirect
+			&& (a[i].attr->map_state == XCB_MAP_STATE_VIEWABLE
+			|| (r && r->format == 32 && xcb_get_property_value_length(r) >= 4
+			&& *(uint32_t *)xcb_get_property_value(r) == IconicState));
+		free(r);
+		if (ok)
+			when[i] = (r = a[i].prop[PropTransient]) && r->format == 32
+				&& xcb_get_property_value_length(r) >= 4 ? 2 : 1;
+	}
+	for (pass = 1; pass <= 2; pass++)
+		for (i = 0; i < n; i++)
+			if (when[i] == pass)
+				manage(&a[i]);
+	for (i = 0; i < n; i++)
+		adoptfree(&a[i]);
+	free(when);
+	free(stateck);
+	free(a);
+	free(tree);
 	focus(NULL);
 }
 
@@ -1039,7 +3776,7 @@ setfullscreen(Client *c, int fullscreen)
 		c->bw = 0;
 		c->isfloating = 1;
 		resizeclient(c, c->mon->mx, c->mon->my, c->mon->mw, c->mon->mh);
-		XRaiseWindow(dpy, c->win);
+		raiseclient(c);
 	} else if (!fullscreen && c->isfullscreen){
 		XChangeProperty(dpy, c->win, netatom[NetWMState], XA_ATOM, 32,
 			PropModeReplace, (unsigned char*)0, 0);
@@ -1072,14 +3809,11 @@ clientmessage(XEvent *e)
 
 
 void
-updatewindowtype(Client *c)
+updatewindowtype(Client *c, xcb_get_property_reply_t *state, xcb_get_property_reply_t *wtype)
 {
-	Atom state = getatomprop(c, netatom[NetWMState]);
-	Atom wtype = getatomprop(c, netatom[NetWMWindowType]);
-
-	if (state == netatom[NetWMFullscreen])
+	if (hasatom(state, netatom[NetWMFullscreen]))
 		setfullscreen(c, 1);
-	if (wtype == netatom[NetWMWindowTypeDialog])
+	if (hasatom(wtype, netatom[NetWMWindowTypeDialog]))
 		c->isfloating = 1;
 }
 
@@ -1095,22 +3829,39 @@ destroynotify(XEvent *e)
 }
 
 void
-updatewmhints(Client *c)
+updatewmhints(Client *c, xcb_get_property_reply_t *r)
 {
-	XWMHints *wmh;
+	long data[9] = { 0 };
+	uint32_t *p;
+	int i, n;
 
-	if ((wmh = XGetWMHints(dpy, c->win))) {
-		if (c == selmon->sel && wmh->flags & XUrgencyHint) {
-			wmh->flags &= ~XUrgencyHint;
-			XSetWMHints(dpy, c->win, wmh);
-		} else
-			c->isurgent = (wmh->flags & XUrgencyHint) ? 1 : 0;
-		if (wmh->flags & InputHint)
-			c->neverfocus = !wmh->input;
-		else
-			c->neverfocus = 0;
-		XFree(wmh);
-	}
+	if (!r || r->format != 32 || (n = xcb_get_property_value_length(r) / 4) < 2)
+		return;
+	p = xcb_get_property_value(r);
+	for (i = 0; i < MIN(n, LENGTH(data)); i++)
+		data[i] = p[i];
+	/* data[0] is the flags word, data[1] the input field */
+	if (c == selmon->sel && data[0] & XUrgencyHint) {
+		data[0] &= ~XUrgencyHint;
+		XChangeProperty(dpy, c->win, XA_WM_HINTS, XA_WM_HINTS, 32,
+			PropModeReplace, (unsigned char *)data, MIN(n, LENGTH(data)));
+	} else
+		c->isurgent = (data[0] & XUrgencyHint) ? 1 : 0;
+	if (data[0] & InputHint)
+		c->neverfocus = !data[1];
+	else
+		c->neverfocus = 0;
+}
+
+void
+updateprotocols(Client *c, xcb_get_property_reply_t *r)
+{
+	int i;
+
+	c->protocols = 0;
+	for (i = 0; i < WMLast; i++)
+		if (hasatom(r, wmatom[i]))
+			c->protocols |= 1 << i;
 }
 
 void
@@ -1144,15 +3895,18 @@ void
 focus(Client *c)
 {
 	if (!c)
-		c = selmon->clients;
+		c = selmon->selframe->sel;
 	if (selmon->sel && selmon->sel != c)
 		unfocus(selmon->sel, 0);
 	if (c) {
 		if (c->mon != selmon)
 			selmon = c->mon;
-		detachstack(c);
-		attachstack(c);
+		if (c != cyclesel)
+			promote(c);
 		selmon->sel = c;
+		selmon->selframe = c->frame;
+		c->frame->sel = c;
+		refresh(c, StaleHints); /* for neverfocus, clears urgency */
 		XSetWindowBorder(dpy, c->win, scheme[SchemeSel][ColBorder].pixel);
 		if (!c->neverfocus) {
 			XSetInputFocus(dpy, c->win, RevertToPointerRoot, CurrentTime);
@@ -1160,18 +3914,24 @@ focus(Client *c)
 					XA_WINDOW, 32, PropModeReplace,
 					(unsigned char *) &(c->win), 1);
 		}
-		sendevent(c, wmatom[WMTakeFocus]);
-		XRaiseWindow(dpy, c->win);
+		sendevent(c, WMTakeFocus);
+		raiseclient(c);
 	} else {
+		selmon->sel = NULL;
 		XSetInputFocus(dpy, root, RevertToPointerRoot, CurrentTime);
 		XDeleteProperty(dpy, root, netatom[NetActiveWindow]);
 	}
+	markbar(selmon, SegFrame);
+	markbar(selmon, SegTitle);
+	ipcnotify(IpcEvFocus, c ? c->win : None);
 }
 
 void
 resizeclient(Client *c, int x, int y, int w, int h)
 {
 	XWindowChanges wc;
+	/* a real ConfigureNotify follows unless the geometry stays */
+	int same = c->x == x && c->y == y && c->w == w && c->h == h;
 
 	c->oldx = c->x; c->x = wc.x = x;
 	c->oldy = c->y; c->y = wc.y = y;
@@ -1179,8 +3939,8 @@ resizeclient(Client *c, int x, int y, int w, int h)
 	c->oldh = c->h; c->h = wc.height = h;
 	wc.border_width = c->bw;
 	XConfigureWindow(dpy, c->win, CWX|CWY|CWWidth|CWHeight|CWBorderWidth, &wc);
-	configure(c);
-	XSync(dpy, False);
+	if (same)
+		configure(c);
 }
 
 
@@ -1190,34 +3950,61 @@ cleanup(void)
 	Monitor *m;
 	size_t i;
 
-	for (m = mons; m; m = m->next)
-		while (m->clients)
+	for (m = mons; m; m = m->next) {
+		/* on restart the clients stay as they are for the next kwm */
+		while (!restarting && m->clients)
 			unmanage(m->clients, 0);
+		if (m->barwin)
+			XDestroyWindow(dpy, m->barwin);
+	}
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
+	freekeymaps();
+	closemenu();
+	while (ipcclients)
+		ipcclose(ipcclients);
+	if (ipcwatch.fd >= 0) {
+		close(ipcwatch.fd);
+		unlink(ipcpath);
+	}
+	close(timerwatch.fd);
+	close(sigwatch.fd);
+	close(epfd);
 	for (i = 0; i < CurLast; i++)
 		drw_cur_free(drw, cursor[i]);
 	for (i = 0; i < LENGTH(colors); i++)
 		free(scheme[i]);
+	free(clienttab);
+	free(clientlist);
+	free(stacklist);
 	XDestroyWindow(dpy, wmcheckwin);
 	drw_free(drw);
-	XSync(dpy, False);
-	XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
-	XDeleteProperty(dpy, root, netatom[NetActiveWindow]);
+	slab_destroy(clientslab);
+	slab_destroy(monslab);
+	slab_destroy(frameslab);
+	if (!restarting) {
+		XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
+		XDeleteProperty(dpy, root, netatom[NetActiveWindow]);
+	}
+	XDeleteProperty(dpy, root, netatom[NetClientList]);
+	XDeleteProperty(dpy, root, netatom[NetClientListStacking]);
 }
 
 
 void
 maprequest(XEvent *e)
 {
-	static XWindowAttributes wa;
+	Adoption a;
 	XMapRequestEvent *ev = &e->xmaprequest;
-	
-	if (!XGetWindowAttributes(dpy, ev->window, &wa))
-		return;
-	if (wa.override_redirect)
+	Client *c;
+
+	if (wintoclient(ev->window))
 		return;
-	if (!wintoclient(ev->window))
-		manage(ev->window, &wa);
+	adoptrequest(&a, ev->window);
+	if (ROUNDTRIP(adoptreply(&a)) && !a.attr->override_redirect) {
+		c = manage(&a);
+		focus(c->mon == selmon ? c : NULL);
+	}
+	adoptfree(&a);
 }
 
 
@@ -1234,8 +4021,17 @@ main(int argc, char *argv[])
 		die("kwm: cannot open display");
 	checkotherwm();
 	setup();
+	scan();
 	run();
+	dumpstats();
 	cleanup();
 	XCloseDisplay(dpy);
+	if (restarting) {
+		/* setup blocks them again, the new kwm's children need them */
+		sigprocmask(SIG_SETMASK, &origmask, NULL);
+		execvp(argv[0], argv);
+		perror("kwm: restart failed");
+		return 1;
+	}
 	return 0;
 }
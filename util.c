@@ -6,6 +6,96 @@
 
 #include "util.h"
 
+#define SLABALIGN  (2 * sizeof(void *))
+#define SLABPOISON 0x6b
+
+struct SlabPage {
+	SlabPage *next;
+};
+
+/* page header, padded so the first object is aligned */
+#define SLABHDR    ((sizeof(SlabPage) + SLABALIGN - 1) & ~(SLABALIGN - 1))
+
+Slab *
+slab_create(size_t size, size_t perpage)
+{
+	Slab *s = ecalloc(1, sizeof(Slab));
+
+	s->size = (MAX(size, sizeof(void *)) + SLABALIGN - 1) & ~(SLABALIGN - 1);
+	s->perpage = MAX(perpage, 1);
+	return s;
+}
+
+void *
+slab_alloc(Slab *s)
+{
+	SlabPage *pg;
+	unsigned char *p;
+#ifdef SLABDEBUG
+	size_t i;
+#endif /* SLABDEBUG */
+
+	if ((p = s->free)) {
+		s->free = *(void **)p;
+#ifdef SLABDEBUG
+		/* a freed slot that was written to is a use after free */
+		for (i = sizeof(void *); i < s->size; i++)
+			if (p[i] != SLABPOISON)
+				die("slab: write to freed object\n");
+#endif /* SLABDEBUG */
+	} else {
+		if (!s->fresh) {
+			pg = ecalloc(1, SLABHDR + s->perpage * s->size);
+			pg->next = s->pages;
+			s->pages = pg;
+			s->fresh = s->perpage;
+			s->npages++;
+		}
+		/* hand out a new page front to back */
+		p = (unsigned char *)s->pages + SLABHDR + (s->perpage - s->fresh--) * s->size;
+	}
+	memset(p, 0, s->size);
+	s->allocs++;
+	if (++s->inuse > s->peak)
+		s->peak = s->inuse;
+	return p;
+}
+
+void
+slab_free(Slab *s, void *p)
+{
+#ifdef SLABDEBUG
+	size_t i;
+#endif /* SLABDEBUG */
+
+	if (!p)
+		return;
+#ifdef SLABDEBUG
+	for (i = sizeof(void *); i < s->size && ((unsigned char *)p)[i] == SLABPOISON; i++);
+	if (i == s->size)
+		die("slab: object freed twice\n");
+	memset(p, SLABPOISON, s->size);
+#endif /* SLABDEBUG */
+	*(void **)p = s->free;
+	s->free = p;
+	s->inuse--;
+	s->frees++;
+}
+
+void
+slab_destroy(Slab *s)
+{
+	SlabPage *pg;
+
+	if (!s)
+		return;
+	while ((pg = s->pages)) {
+		s->pages = pg->next;
+		free(pg);
+	}
+	free(s);
+}
+
 void *
 ecalloc(size_t nmemb, size_t size)
 {
@@ -16,6 +106,14 @@ ecalloc(size_t nmemb, size_t size)
 	return p;
 }
 
+void *
+erealloc(void *p, size_t size)
+{
+	if (!(p = realloc(p, size)))
+		die("realloc:");
+	return p;
+}
+
 void
 die(const char *message) {
 	fputs(message, stdout);
@@ -2,5 +2,26 @@
 #define MIN(A, B)               ((A) < (B) ? (A) : (B))
 #define BETWEEN(X, A, B)        ((A) <= (X) && (X) <= (B))
 
+typedef struct SlabPage SlabPage;
+
+/* Fixed-size object allocator: objects are carved out of contiguous
+ * pages and recycled through a free list. */
+typedef struct {
+	size_t size;      /* object size, rounded up for alignment */
+	size_t perpage;   /* objects per page */
+	SlabPage *pages;
+	void *free;       /* free slots, linked through their first word */
+	size_t fresh;     /* never used slots left in the newest page */
+	/* statistics */
+	size_t npages, inuse, peak;
+	unsigned long allocs, frees;
+} Slab;
+
+Slab *slab_create(size_t size, size_t perpage);
+void *slab_alloc(Slab *s);
+void slab_free(Slab *s, void *p);
+void slab_destroy(Slab *s);
+
 void *ecalloc(size_t nmemb, size_t size);
+void *erealloc(void *p, size_t size);
 void die(const char*);